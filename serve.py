@@ -1,16 +1,53 @@
 #!/usr/bin/env python3
+import os
+import re
 from http.server import HTTPServer, SimpleHTTPRequestHandler
 
+# Build outputs carry a content hash (index.3f2a9c1b7d04.wasm): safe to cache forever
+HASHED_ASSET = re.compile(r'\.[0-9a-f]{12}\.(js|wasm)$')
+
+# Precompressed siblings written by the build, best first
+ENCODINGS = [('br', '.br'), ('gzip', '.gz')]
+
 class Handler(SimpleHTTPRequestHandler):
+    extensions_map = dict(SimpleHTTPRequestHandler.extensions_map, **{
+        '.wasm': 'application/wasm',  # Required by WebAssembly.compileStreaming
+        '.js': 'text/javascript',
+    })
+
+    def send_head(self):
+        path = self.translate_path(self.path)
+        accepted = self.headers.get('Accept-Encoding', '')
+
+        for encoding, suffix in ENCODINGS:
+            if encoding in accepted and os.path.isfile(path + suffix):
+                try:
+                    f = open(path + suffix, 'rb')
+                except OSError:
+                    continue
+                self.send_response(200)
+                self.send_header('Content-Type', self.guess_type(path))
+                self.send_header('Content-Encoding', encoding)
+                self.send_header('Content-Length', str(os.fstat(f.fileno()).st_size))
+                self.send_header('Vary', 'Accept-Encoding')
+                self.end_headers()
+                return f
+
+        return super().send_head()
+
     def end_headers(self):
         self.send_header('Cross-Origin-Opener-Policy', 'same-origin')
         self.send_header('Cross-Origin-Embedder-Policy', 'require-corp')
-        self.send_header('Cache-Control', 'no-store')
+        if HASHED_ASSET.search(self.path.split('?')[0]):
+            self.send_header('Cache-Control', 'public, max-age=31536000, immutable')
+        else:
+            self.send_header('Cache-Control', 'no-cache')
         super().end_headers()
 
 if __name__ == '__main__':
     print('🚀 Server running on http://localhost:8000')
     print('📡 COOP/COEP headers enabled for multi-threading')
+    print('📦 Precompressed assets (br/gzip) with immutable caching for hashed files')
     print('🧵 4-thread CPU support enabled (~4x faster)')
     print('🎮 WebGPU API enabled (experimental)')
     print('🤖 Qwen2.5-0.5B-Instruct ready to load')
@@ -19,4 +56,3 @@ if __name__ == '__main__':
         HTTPServer(('', 8000), Handler).serve_forever()
     except KeyboardInterrupt:
         print('\n👋 Server stopped')
-
@@ -0,0 +1,639 @@
+#include "batch.h"
+#include "chat.h"
+#include "json.h"
+#include "llama.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <emscripten.h>
+
+// Requests without "max_tokens"
+static const int kDefaultMaxTokens = 256;
+
+// Prompt tokens one slot may add to a step; generating slots are batched first
+static const size_t kSlotPrefillChunk = 128;
+
+// Results between two IDBFS syncs (a crash loses at most these)
+static const size_t kSyncEvery = 16;
+
+// Latency histogram bucket upper bounds; one more bucket counts the rest
+static const double kLatencyBucketsMs[] = { 250, 500, 1000, 2000, 4000, 8000, 16000, 32000 };
+static const size_t kLatencyBuckets = sizeof(kLatencyBucketsMs) / sizeof(kLatencyBucketsMs[0]);
+
+// Minimal JSON reader for input records: strings, numbers, arrays, objects,
+// literals. Values of unknown keys are skipped.
+class JsonReader {
+public:
+    explicit JsonReader(std::string_view text) : s(text), p(0) {}
+    
+    bool consume(char c) {
+        skipSpace();
+        if (p < s.size() && s[p] == c) {
+            p++;
+            return true;
+        }
+        return false;
+    }
+    
+    bool peek(char c) {
+        skipSpace();
+        return p < s.size() && s[p] == c;
+    }
+    
+    bool readString(std::string& out) {
+        out.clear();
+        if (!consume('"')) return false;
+        while (p < s.size()) {
+            char c = s[p++];
+            if (c == '"') return true;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (p >= s.size()) return false;
+            switch (s[p++]) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    uint32_t cp = 0;
+                    if (!readHex4(cp)) return false;
+                    // Surrogate pair
+                    if (cp >= 0xD800 && cp < 0xDC00 && s.substr(p, 2) == "\\u") {
+                        p += 2;
+                        uint32_t low = 0;
+                        if (!readHex4(low)) return false;
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    appendUtf8(out, cp);
+                    break;
+                }
+                default: return false;
+            }
+        }
+        return false;
+    }
+    
+    bool readNumber(double& out) {
+        skipSpace();
+        const char* begin = s.data() + p;
+        char* end = nullptr;
+        std::string copy(begin, std::min<size_t>(s.size() - p, 32));
+        out = strtod(copy.c_str(), &end);
+        if (end == copy.c_str()) return false;
+        p += end - copy.c_str();
+        return true;
+    }
+    
+    bool skipValue() {
+        skipSpace();
+        if (p >= s.size()) return false;
+        char c = s[p];
+        if (c == '"') {
+            std::string ignored;
+            return readString(ignored);
+        }
+        if (c == '{' || c == '[') {
+            char close = c == '{' ? '}' : ']';
+            p++;
+            if (consume(close)) return true;
+            do {
+                if (close == '}') {
+                    std::string key;
+                    if (!readString(key) || !consume(':')) return false;
+                }
+                if (!skipValue()) return false;
+            } while (consume(','));
+            return consume(close);
+        }
+        for (const char* literal : { "true", "false", "null" }) {
+            if (s.substr(p, strlen(literal)) == literal) {
+                p += strlen(literal);
+                return true;
+            }
+        }
+        double ignored;
+        return readNumber(ignored);
+    }
+
+private:
+    void skipSpace() {
+        while (p < s.size() && (s[p] == ' ' || s[p] == '\t' || s[p] == '\n' || s[p] == '\r')) p++;
+    }
+    
+    bool readHex4(uint32_t& out) {
+        if (p + 4 > s.size()) return false;
+        for (int i = 0; i < 4; i++) {
+            char c = s[p++];
+            out <<= 4;
+            if (c >= '0' && c <= '9') out |= c - '0';
+            else if (c >= 'a' && c <= 'f') out |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') out |= c - 'A' + 10;
+            else return false;
+        }
+        return true;
+    }
+    
+    static void appendUtf8(std::string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += (char)cp;
+        } else if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else {
+            out += (char)(0xF0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+    
+    std::string_view s;
+    size_t p;
+};
+
+// Persist /batch (IDBFS, mounted by the page) so a crashed run can resume
+static void syncBatchFS() {
+    EM_ASM({
+        FS.syncfs(false, function(err) {
+            if (err) console.warn('Batch output sync failed:', err);
+        });
+    });
+}
+
+BatchRunner::BatchRunner(LLM& llm)
+    : llm(llm), running(false), input(nullptr), output(nullptr), nextIndex(0),
+      hasWaiting(false), inputDone(false), batch(nullptr), unsynced(0), startTime(0.0) {}
+
+BatchRunner::~BatchRunner() {
+    cancel();
+}
+
+bool BatchRunner::start(const std::string& inputPath, const std::string& outputPath) {
+    if (running) {
+        lastError = "A batch run is already in progress.";
+        return false;
+    }
+    if (!llm.isLoaded() || llm.isGenerating()) {
+        lastError = llm.isLoaded() ? "Cannot start a batch while generating." : "No model loaded.";
+        return false;
+    }
+    
+    input = fopen(inputPath.c_str(), "rb");
+    if (!input) {
+        lastError = "Cannot open batch input: " + inputPath;
+        return false;
+    }
+    
+    loadCompleted(outputPath);
+    output = fopen(outputPath.c_str(), "ab");
+    if (!output) {
+        fclose(input);
+        input = nullptr;
+        lastError = "Cannot open batch output: " + outputPath;
+        return false;
+    }
+    
+    // The run owns the whole KV cache; the chat re-prefills afterwards
+    llm.clearKVCache();
+    
+    slots.assign(llm.getMaxSequences() - 1, Slot());
+    for (size_t i = 0; i < slots.size(); i++) {
+        slots[i].seq = (int)i + 1;
+    }
+    batch = new llama_batch(llama_batch_init((int)llama_n_batch(llm.getContext()), 0, 1));
+    
+    stats = BatchStats();
+    stats.skipped = completed.size();
+    stats.latencyHistogram.assign(kLatencyBuckets + 1, 0);
+    nextIndex = 0;
+    hasWaiting = false;
+    inputDone = false;
+    unsynced = 0;
+    startTime = emscripten_get_now();
+    running = true;
+    
+    printf("Batch started: %s -> %s, %zu slots, %zu records already done\n",
+           inputPath.c_str(), outputPath.c_str(), slots.size(), completed.size());
+    return true;
+}
+
+// Indices already in the output file. A torn last line (crash mid-write) is cut off.
+void BatchRunner::loadCompleted(const std::string& outputPath) {
+    completed.clear();
+    
+    FILE* f = fopen(outputPath.c_str(), "rb");
+    if (!f) return;
+    
+    char* line = nullptr;
+    size_t capacity = 0;
+    ssize_t length;
+    long validBytes = 0;
+    while ((length = getline(&line, &capacity, f)) > 0) {
+        if (line[length - 1] != '\n') break;
+        validBytes += length;
+        
+        const char* key = strstr(line, "\"index\":");
+        if (key) {
+            completed.insert(strtoull(key + 8, nullptr, 10));
+        }
+    }
+    free(line);
+    
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    if (size > validBytes) {
+        truncate(outputPath.c_str(), validBytes);
+    }
+}
+
+// Next input record not done yet; malformed or oversized ones are written as errors
+bool BatchRunner::readRequest(Request& request) {
+    char* line = nullptr;
+    size_t capacity = 0;
+    ssize_t length;
+    bool found = false;
+    
+    while (!found && (length = getline(&line, &capacity, input)) > 0) {
+        std::string_view text(line, length);
+        if (text.find_first_not_of(" \t\r\n") == std::string_view::npos) {
+            continue;
+        }
+        
+        size_t index = nextIndex++;
+        if (completed.count(index)) {
+            continue;
+        }
+        
+        std::string error;
+        request = Request();
+        request.index = index;
+        if (!parseRequest(std::string(text), request, error)) {
+            writeError(index, error);
+            continue;
+        }
+        if (request.tokens.size() + request.maxTokens > llama_n_ctx(llm.getContext())) {
+            writeError(index, "prompt and max_tokens do not fit in the context");
+            continue;
+        }
+        found = true;
+    }
+    free(line);
+    
+    if (!found) {
+        inputDone = true;
+    }
+    return found;
+}
+
+bool BatchRunner::parseRequest(const std::string& line, Request& request, std::string& error) {
+    JsonReader json(line);
+    ChatSession session;
+    std::string key, value, prompt;
+    double number = 0.0;
+    request.maxTokens = kDefaultMaxTokens;
+    
+    error = "malformed JSON";
+    if (!json.consume('{')) return false;
+    if (!json.consume('}')) {
+        do {
+            if (!json.readString(key) || !json.consume(':')) return false;
+            
+            if (key == "id") {
+                if (json.peek('"')) {
+                    if (!json.readString(request.id)) return false;
+                } else {
+                    if (!json.readNumber(number)) return false;
+                    char buf[32];
+                    snprintf(buf, sizeof(buf), "%.0f", number);
+                    request.id = buf;
+                }
+            } else if (key == "prompt") {
+                if (!json.readString(prompt)) return false;
+            } else if (key == "system") {
+                if (!json.readString(value)) return false;
+                session.setSystemPrompt(value);
+            } else if (key == "max_tokens") {
+                if (!json.readNumber(number)) return false;
+                request.maxTokens = std::max(1, (int)number);
+            } else if (key == "seed") {
+                if (!json.readNumber(number)) return false;
+                request.seed = (uint32_t)number;
+                request.hasSeed = true;
+            } else if (key == "messages") {
+                if (!json.consume('[')) return false;
+                if (!json.consume(']')) {
+                    do {
+                        std::string role, content, field;
+                        if (!json.consume('{')) return false;
+                        do {
+                            if (!json.readString(field) || !json.consume(':')) return false;
+                            if (field == "role") {
+                                if (!json.readString(role)) return false;
+                            } else if (field == "content") {
+                                if (!json.readString(content)) return false;
+                            } else if (!json.skipValue()) {
+                                return false;
+                            }
+                        } while (json.consume(','));
+                        if (!json.consume('}')) return false;
+                        
+                        if (role == "system") {
+                            session.setSystemPrompt(content);
+                        } else {
+                            session.addMessage(role == "assistant" ? MessageRole::ASSISTANT : MessageRole::USER, content);
+                        }
+                    } while (json.consume(','));
+                    if (!json.consume(']')) return false;
+                }
+            } else if (!json.skipValue()) {
+                return false;
+            }
+        } while (json.consume(','));
+        if (!json.consume('}')) return false;
+    }
+    
+    if (!prompt.empty()) {
+        session.addMessage(MessageRole::USER, prompt);
+    }
+    if (session.getMessages().empty()) {
+        error = "no prompt or messages";
+        return false;
+    }
+    
+    // Same ChatML layout (and history window) as the chat UI
+    session.setTokenBudget(llm.getPromptBudget(), [this](std::string_view text) {
+        return llm.countTokens(text);
+    });
+    const std::vector<int>& tokens = llm.getTokenizer().tokenize(session.buildPrompt(), true);
+    request.tokens.assign(tokens.begin(), tokens.end());
+    return true;
+}
+
+// KV cells promised to running requests: prompt plus the full generation budget
+size_t BatchRunner::reservedCells() const {
+    size_t cells = 0;
+    for (const Slot& slot : slots) {
+        if (slot.active) {
+            cells += slot.request.tokens.size() + slot.request.maxTokens;
+        }
+    }
+    return cells;
+}
+
+bool BatchRunner::admit(Request& request) {
+    if (reservedCells() + request.tokens.size() + request.maxTokens > llama_n_ctx(llm.getContext())) {
+        return false;
+    }
+    
+    for (Slot& slot : slots) {
+        if (slot.active) continue;
+        
+        SamplerConfig config = llm.getSamplerConfig();
+        if (request.hasSeed) {
+            config.seed = request.seed;
+        }
+        slot.active = true;
+        slot.request = std::move(request);
+        slot.sampler = LLM::createSampler(config);
+        slot.cursor = 0;
+        slot.nextToken = -1;
+        slot.generated = 0;
+        slot.output.clear();
+        slot.start = emscripten_get_now();
+        stats.promptTokens += slot.request.tokens.size();
+        return true;
+    }
+    return false;
+}
+
+// Continuous batching: every step refills free slots, then decodes one token
+// for each generating slot plus prompt chunks for the slots still prefilling
+bool BatchRunner::step() {
+    if (!running) return false;
+    
+    llama_context* ctx = llm.getContext();
+    
+    while (true) {
+        if (!hasWaiting) {
+            if (inputDone || !readRequest(waiting)) break;
+            hasWaiting = true;
+        }
+        if (!admit(waiting)) break;
+        hasWaiting = false;
+    }
+    
+    llama_batch& b = *batch;
+    size_t nBatch = llama_n_batch(ctx);
+    b.n_tokens = 0;
+    size_t busy = 0;
+    
+    auto addRow = [&b](int token, int pos, int seq, bool logits) {
+        int n = b.n_tokens++;
+        b.token[n] = token;
+        b.pos[n] = pos;
+        b.n_seq_id[n] = 1;
+        b.seq_id[n][0] = seq;
+        b.logits[n] = logits;
+        return n;
+    };
+    
+    for (Slot& slot : slots) {
+        slot.logitIndex = -1;
+        if (!slot.active) continue;
+        busy++;
+        if (slot.nextToken >= 0) {
+            int pos = (int)slot.request.tokens.size() + slot.generated - 1;
+            slot.logitIndex = addRow(slot.nextToken, pos, slot.seq, true);
+            slot.nextToken = -1;
+        }
+    }
+    for (Slot& slot : slots) {
+        size_t remaining = slot.active ? slot.request.tokens.size() - slot.cursor : 0;
+        size_t n = std::min({ remaining, kSlotPrefillChunk, nBatch - (size_t)b.n_tokens });
+        for (size_t i = 0; i < n; i++) {
+            bool last = slot.cursor + 1 == slot.request.tokens.size();
+            int row = addRow(slot.request.tokens[slot.cursor], (int)slot.cursor, slot.seq, last);
+            if (last) slot.logitIndex = row;
+            slot.cursor++;
+        }
+    }
+    
+    if (b.n_tokens == 0) {
+        if (busy == 0 && inputDone && !hasWaiting) {
+            finish();
+        }
+        return running;
+    }
+    
+    if (llama_decode(ctx, b) != 0) {
+        lastError = "Batch decode failed";
+        printf("%s at step %llu\n", lastError.c_str(), (unsigned long long)stats.steps);
+        finish();
+        return false;
+    }
+    stats.steps++;
+    stats.busySlotSteps += busy;
+    stats.totalSlotSteps += slots.size();
+    
+    const llama_vocab* vocab = llm.getVocab();
+    const Tokenizer& tokenizer = llm.getTokenizer();
+    for (Slot& slot : slots) {
+        if (slot.logitIndex < 0) continue;
+        
+        int token = llama_sampler_sample(slot.sampler, ctx, slot.logitIndex);
+        std::string_view piece = tokenizer.piece(token);
+        if (llama_vocab_is_eog(vocab, token) || piece.find("<|") != std::string_view::npos) {
+            finishSlot(slot);
+            continue;
+        }
+        
+        slot.output.append(piece.data(), piece.size());
+        slot.generated++;
+        stats.generatedTokens++;
+        if (slot.generated >= slot.request.maxTokens) {
+            finishSlot(slot);
+        } else {
+            slot.nextToken = token;
+        }
+    }
+    return true;
+}
+
+void BatchRunner::finishSlot(Slot& slot) {
+    double ms = emscripten_get_now() - slot.start;
+    writeResult(slot.request, slot.output, slot.generated, ms);
+    
+    stats.completed++;
+    stats.latenciesMs.push_back(ms);
+    size_t bucket = std::upper_bound(kLatencyBucketsMs, kLatencyBucketsMs + kLatencyBuckets, ms) - kLatencyBucketsMs;
+    stats.latencyHistogram[bucket]++;
+    
+    llama_memory_seq_rm(llama_get_memory(llm.getContext()), slot.seq, -1, -1);
+    llama_sampler_free(slot.sampler);
+    
+    int seq = slot.seq;
+    slot = Slot();
+    slot.seq = seq;
+}
+
+void BatchRunner::writeResult(const Request& request, const std::string& text, int generated, double ms) {
+    std::string line = "{\"index\":" + std::to_string(request.index) + ",\"id\":";
+    appendJsonString(line, request.id);
+    line += ",\"output\":";
+    appendJsonString(line, text);
+    
+    char buf[96];
+    snprintf(buf, sizeof(buf), ",\"prompt_tokens\":%zu,\"completion_tokens\":%d,\"ms\":%.1f}\n",
+             request.tokens.size(), generated, ms);
+    line += buf;
+    writeLine(line);
+}
+
+void BatchRunner::writeError(size_t index, const std::string& error) {
+    std::string line = "{\"index\":" + std::to_string(index) + ",\"error\":";
+    appendJsonString(line, error);
+    line += "}\n";
+    writeLine(line);
+    stats.failed++;
+}
+
+// Results and errors share the sync cadence, so a run that mostly fails
+// still reaches IDBFS before the tab closes
+void BatchRunner::writeLine(const std::string& line) {
+    fwrite(line.data(), 1, line.size(), output);
+    fflush(output);
+    if (++unsynced >= kSyncEvery) {
+        syncBatchFS();
+        unsynced = 0;
+    }
+}
+
+void BatchRunner::cancel() {
+    if (!running) return;
+    printf("Batch cancelled\n");
+    finish();
+}
+
+void BatchRunner::finish() {
+    llama_context* ctx = llm.getContext();
+    for (Slot& slot : slots) {
+        if (!slot.active) continue;
+        if (ctx) {
+            llama_memory_seq_rm(llama_get_memory(ctx), slot.seq, -1, -1);
+        }
+        llama_sampler_free(slot.sampler);
+    }
+    slots.clear();
+    
+    if (batch) {
+        llama_batch_free(*batch);
+        delete batch;
+        batch = nullptr;
+    }
+    if (input) {
+        fclose(input);
+        input = nullptr;
+    }
+    if (output) {
+        fclose(output);
+        output = nullptr;
+    }
+    syncBatchFS();
+    
+    running = false;
+    stats.elapsedMs = emscripten_get_now() - startTime;
+    report();
+}
+
+void BatchRunner::report() const {
+    double seconds = stats.elapsedMs / 1000.0;
+    printf("Batch done: %zu completed, %zu failed, %zu skipped in %.1f s (%.2f req/s)\n",
+           stats.completed, stats.failed, stats.skipped, seconds,
+           seconds > 0 ? stats.completed / seconds : 0.0);
+    printf("Tokens: %llu prompt (%.0f tok/s), %llu generated (%.1f tok/s), %llu batched decodes\n",
+           (unsigned long long)stats.promptTokens, seconds > 0 ? stats.promptTokens / seconds : 0.0,
+           (unsigned long long)stats.generatedTokens, seconds > 0 ? stats.generatedTokens / seconds : 0.0,
+           (unsigned long long)stats.steps);
+    
+    // Idle slots are the padding of continuous batching: sequences with nothing to decode
+    double utilization = stats.totalSlotSteps ? 100.0 * stats.busySlotSteps / stats.totalSlotSteps : 0.0;
+    printf("Slot utilization: %.1f%% (%.1f%% idle)\n", utilization, 100.0 - utilization);
+    
+    if (stats.latenciesMs.empty()) return;
+    
+    std::vector<double> sorted = stats.latenciesMs;
+    std::sort(sorted.begin(), sorted.end());
+    printf("Latency: p50 %.0f ms, p95 %.0f ms, max %.0f ms\n",
+           sorted[sorted.size() / 2], sorted[std::min(sorted.size() - 1, sorted.size() * 95 / 100)], sorted.back());
+    for (size_t i = 0; i <= kLatencyBuckets; i++) {
+        if (i < kLatencyBuckets) {
+            printf("  <%6.0f ms: %u\n", kLatencyBucketsMs[i], stats.latencyHistogram[i]);
+        } else {
+            printf("  >=%5.0f ms: %u\n", kLatencyBucketsMs[kLatencyBuckets - 1], stats.latencyHistogram[i]);
+        }
+    }
+}
+
+bool BatchRunner::isRunning() const {
+    return running;
+}
+
+const BatchStats& BatchRunner::getStats() const {
+    return stats;
+}
+
+const std::string& BatchRunner::getLastError() const {
+    return lastError;
+}
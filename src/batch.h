@@ -0,0 +1,102 @@
+#pragma once
+#include "llm.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_set>
+#include <cstdio>
+#include <cstdint>
+
+struct llama_sampler;
+
+// End-of-run report. Slot utilization is the share of slot-steps that had
+// a request in them; the rest is waste from idle sequences.
+struct BatchStats {
+    size_t completed = 0;
+    size_t failed = 0;
+    size_t skipped = 0;        // Already in the output file (resumed run)
+    uint64_t promptTokens = 0;
+    uint64_t generatedTokens = 0;
+    uint64_t steps = 0;        // Batched decodes
+    uint64_t busySlotSteps = 0;
+    uint64_t totalSlotSteps = 0;
+    double elapsedMs = 0.0;
+    std::vector<uint32_t> latencyHistogram; // Counts per kLatencyBucketsMs bucket, + overflow
+    std::vector<double> latenciesMs;
+};
+
+// Headless batch inference: streams a JSONL file of conversations, runs them
+// with continuous batching (one sequence per slot, refilled as soon as a
+// request finishes) and appends one JSONL result per request.
+//
+// Input lines:  {"id": "q1", "system": "...", "messages": [{"role": "user", "content": "..."}],
+//                "max_tokens": 128, "seed": 7}   ("prompt": "..." is a single user message)
+// Output lines: {"index": 0, "id": "q1", "output": "...", "prompt_tokens": 31,
+//                "completion_tokens": 42, "ms": 812.5}   or {"index": 0, "error": "..."}
+//
+// Records finish out of order; "index" is the input line number. A rerun with
+// the same output file skips every index already written there.
+class BatchRunner {
+public:
+    explicit BatchRunner(LLM& llm);
+    ~BatchRunner();
+    
+    bool start(const std::string& inputPath, const std::string& outputPath);
+    bool step(); // One batched decode per call; returns true while running
+    void cancel();
+    bool isRunning() const;
+    
+    const BatchStats& getStats() const;
+    const std::string& getLastError() const;
+
+private:
+    struct Request {
+        size_t index = 0;
+        std::string id;
+        std::vector<int> tokens;
+        int maxTokens = 0;
+        uint32_t seed = 0;
+        bool hasSeed = false;
+    };
+    
+    struct Slot {
+        bool active = false;
+        int seq = 0;
+        Request request;
+        llama_sampler* sampler = nullptr;
+        size_t cursor = 0;    // Prompt tokens decoded so far
+        int nextToken = -1;   // Sampled, decoded on the next step
+        int generated = 0;
+        int logitIndex = -1;  // Batch row holding this slot's logits
+        std::string output;
+        double start = 0.0;
+    };
+    
+    bool readRequest(Request& request);
+    bool parseRequest(const std::string& line, Request& request, std::string& error);
+    bool admit(Request& request);
+    void finishSlot(Slot& slot);
+    void writeResult(const Request& request, const std::string& output, int generated, double ms);
+    void writeError(size_t index, const std::string& error);
+    void writeLine(const std::string& line);
+    void loadCompleted(const std::string& outputPath);
+    void finish();
+    void report() const;
+    size_t reservedCells() const;
+    
+    LLM& llm;
+    bool running;
+    FILE* input;
+    FILE* output;
+    size_t nextIndex;           // Input line number of the next record
+    std::unordered_set<size_t> completed;
+    bool hasWaiting;
+    Request waiting;            // Read but not admitted yet (KV cells busy)
+    bool inputDone;
+    std::vector<Slot> slots;
+    llama_batch* batch;
+    size_t unsynced;            // Results written since the last IDBFS sync
+    double startTime;
+    BatchStats stats;
+    std::string lastError;
+};
@@ -1,17 +1,78 @@
 #include "chat.h"
+#include "tokenizer.h"
+#include <algorithm>
+
+// Messages are sent verbatim while they fit the token budget. When they
+// outgrow it, the window start jumps forward until the turns fill only this
+// share of the budget, so the prompt prefix (and the KV cache holding it)
+// survives the next several turns; it is prefilled again only after a jump.
+static const float kWindowRefill = 0.5f;
+
+// ChatML markers around each turn, in tokens
+static const size_t kTurnOverheadTokens = 5;
+
+// Summary jobs fold in a few messages at a time, each clipped, so one job
+// stays small next to the conversation in the shared KV cache
+static const size_t kSummaryBatch = 4;
+static const size_t kSummaryMessageChars = 600;
+static const size_t kSummaryMaxChars = 1000;
 
 ChatSession::ChatSession() 
-    : systemPrompt("You are Qwen, created by Alibaba Cloud. You are a helpful assistant.") {}
+    : systemPrompt("You are Qwen, created by Alibaba Cloud. You are a helpful assistant."),
+      summarizedCount(0), windowBegin(0), summaryInPrompt(true), tokenBudget(0) {}
+
+void ChatSession::addMessage(MessageRole role, std::string_view content) {
+    messages.push(role, content);
+}
+
+void ChatSession::appendToMessage(size_t index, std::string_view text) {
+    messages.append(index, text);
+}
+
+void ChatSession::removeLastMessage() {
+    messages.popBack();
+    summarizedCount = std::min(summarizedCount, messages.size());
+    windowBegin = std::min(windowBegin, messages.size());
+}
+
+void ChatSession::removeMessage(size_t index) {
+    if (index >= messages.size()) return;
+    
+    messages.erase(index);
+    if (index < summarizedCount) {
+        summarizedCount--;
+    }
+    if (index < windowBegin) {
+        windowBegin--;
+    }
+}
 
-void ChatSession::addMessage(MessageRole role, const std::string& content) {
-    messages.emplace_back(role, content);
+void ChatSession::replaceLastMessage(std::string_view content) {
+    if (messages.empty()) return;
+    
+    MessageRole role = messages.back().role;
+    messages.popBack();
+    messages.push(role, content);
 }
 
 void ChatSession::clearMessages() {
     messages.clear();
+    summary.clear();
+    summarizedCount = 0;
+    windowBegin = 0;
+}
+
+// Only summarized messages go: the model still sees them through the summary
+void ChatSession::trimHistory() {
+    size_t drop = std::min(windowStart(), summarizedCount);
+    if (drop == 0) return;
+    
+    messages.dropFront(drop);
+    summarizedCount -= drop;
+    windowBegin -= drop;
 }
 
-const std::vector<Message>& ChatSession::getMessages() const {
+const MessageStore& ChatSession::getMessages() const {
     return messages;
 }
 
@@ -23,23 +84,152 @@ std::string ChatSession::getSystemPrompt() const {
     return systemPrompt;
 }
 
-std::string ChatSession::buildPrompt() const {
-    // Qwen2.5 ChatML format
-    std::string prompt = "<|im_start|>system\n" + systemPrompt + "<|im_end|>\n";
-    
-    // Include last 3 exchanges (6 messages) for context
-    size_t start_idx = messages.size() > 6 ? messages.size() - 6 : 0;
-    
-    for (size_t i = start_idx; i < messages.size(); i++) {
-        const auto& msg = messages[i];
+void ChatSession::appendSystem(std::string& prompt) const {
+    prompt += "<|im_start|>system\n";
+    prompt += systemPrompt;
+    if (!summary.empty() && summaryInPrompt) {
+        prompt += "\n\nSummary of the earlier conversation: ";
+        prompt += summary;
+    }
+    prompt += "<|im_end|>\n";
+}
+
+// Qwen2.5 ChatML turns for messages[start, size)
+void ChatSession::appendTurns(std::string& prompt, size_t start) const {
+    for (size_t i = start; i < messages.size(); i++) {
+        Message msg = messages[i];
         if (msg.role == MessageRole::USER) {
-            prompt += "<|im_start|>user\n" + msg.content + "<|im_end|>\n";
+            prompt += "<|im_start|>user\n";
         } else if (msg.role == MessageRole::ASSISTANT && !msg.content.empty()) {
-            prompt += "<|im_start|>assistant\n" + msg.content + "<|im_end|>\n";
+            prompt += "<|im_start|>assistant\n";
+        } else {
+            continue;
         }
+        prompt += msg.content;
+        prompt += "<|im_end|>\n";
     }
+}
+
+void ChatSession::setTokenBudget(size_t tokens, std::function<size_t(std::string_view)> counter) {
+    tokenBudget = tokens;
+    countTokens = std::move(counter);
+}
+
+size_t ChatSession::windowStart() const {
+    return std::min(windowBegin, messages.size());
+}
+
+size_t ChatSession::turnTokens(size_t index) const {
+    return countTokens(messages[index].content) + kTurnOverheadTokens;
+}
+
+// Moves the window start forward if the system turn, the window and
+// extraTokens (what follows the history) exceed the budget. The newest
+// message always stays; the summary is left out when both do not fit.
+size_t ChatSession::fitWindow(size_t extraTokens) {
+    windowBegin = windowStart();
+    summaryInPrompt = true;
+    if (!countTokens || tokenBudget == 0) {
+        return windowBegin;
+    }
+    
+    std::string system;
+    appendSystem(system);
+    size_t fixed = countTokens(system) + extraTokens;
+    size_t newest = messages.empty() ? 0 : turnTokens(messages.size() - 1);
+    if (!summary.empty() && fixed + newest > tokenBudget) {
+        summaryInPrompt = false;
+        system.clear();
+        appendSystem(system);
+        fixed = countTokens(system) + extraTokens;
+    }
+    size_t budget = tokenBudget > fixed ? tokenBudget - fixed : 0;
+    
+    size_t total = 0;
+    for (size_t i = windowBegin; i < messages.size(); i++) {
+        total += turnTokens(i);
+    }
+    if (total <= budget) {
+        return windowBegin;
+    }
+    
+    size_t target = (size_t)(budget * kWindowRefill);
+    while (windowBegin + 1 < messages.size() && total > target) {
+        total -= turnTokens(windowBegin);
+        windowBegin++;
+    }
+    return windowBegin;
+}
+
+std::string ChatSession::buildPrompt() {
+    // Qwen2.5 ChatML format
+    size_t start = fitWindow(kTurnOverheadTokens);
+    std::string prompt;
+    appendSystem(prompt);
+    appendTurns(prompt, start);
     
     prompt += "<|im_start|>assistant\n";
     return prompt;
 }
 
+std::string ChatSession::buildDraftPrompt(std::string_view draft) {
+    // Same window buildPrompt() will use once the draft is sent as a user message
+    size_t extra = countTokens ? countTokens(draft) + 2 * kTurnOverheadTokens : 0;
+    size_t start = fitWindow(extra);
+    std::string prompt;
+    appendSystem(prompt);
+    appendTurns(prompt, start);
+    
+    prompt += "<|im_start|>user\n";
+    prompt += draft;
+    return prompt;
+}
+
+bool ChatSession::hasPendingSummary() const {
+    return summarizedCount < windowStart();
+}
+
+std::string ChatSession::buildSummaryPrompt(size_t& upTo) const {
+    upTo = std::min(windowStart(), summarizedCount + kSummaryBatch);
+    
+    std::string prompt = "<|im_start|>system\nYou condense conversations. Reply with the summary only.<|im_end|>\n";
+    prompt += "<|im_start|>user\nSummary so far: ";
+    prompt += summary.empty() ? "(none)" : summary;
+    prompt += "\n\nNew messages:\n";
+    for (size_t i = summarizedCount; i < upTo; i++) {
+        Message msg = messages[i];
+        if (msg.content.empty()) continue;
+        prompt += msg.role == MessageRole::USER ? "User: " : "Assistant: ";
+        prompt += msg.content.substr(0, kSummaryMessageChars);
+        prompt += "\n";
+    }
+    prompt += "\nUpdate the summary to cover the new messages, in at most 4 sentences.<|im_end|>\n";
+    prompt += "<|im_start|>assistant\n";
+    return prompt;
+}
+
+// from guards against stale jobs: the history may have changed since the prompt was built
+bool ChatSession::applySummary(size_t from, size_t upTo, std::string_view text) {
+    if (from != summarizedCount || upTo > messages.size() || upTo <= from) {
+        return false;
+    }
+    
+    size_t begin = text.find_first_not_of(" \n");
+    size_t end = text.find_last_not_of(" \n");
+    if (begin == std::string_view::npos) {
+        return false;
+    }
+    // The cap can land inside a multi-byte character; cut before it instead
+    std::string_view kept = text.substr(begin, std::min(end - begin + 1, kSummaryMaxChars));
+    summary.assign(kept.substr(0, completeUtf8Prefix(kept)));
+    summarizedCount = upTo;
+    return true;
+}
+
+size_t ChatSession::getSummarizedCount() const {
+    return summarizedCount;
+}
+
+const std::string& ChatSession::getSummary() const {
+    return summary;
+}
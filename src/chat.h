@@ -2,22 +2,56 @@
 #include "message.h"
 #include <vector>
 #include <string>
+#include <functional>
 
 class ChatSession {
 public:
     ChatSession();
     
-    void addMessage(MessageRole role, const std::string& content);
+    void addMessage(MessageRole role, std::string_view content);
+    void appendToMessage(size_t index, std::string_view text);
+    void removeLastMessage();
+    void removeMessage(size_t index);
+    void replaceLastMessage(std::string_view content); // Same role, new text
     void clearMessages();
-    const std::vector<Message>& getMessages() const;
+    void trimHistory(); // Drops messages already folded into the summary (memory pressure)
+    const MessageStore& getMessages() const;
     
     void setSystemPrompt(const std::string& prompt);
     std::string getSystemPrompt() const;
     
-    std::string buildPrompt() const;
+    // The prompt window is bounded by tokens: system turn plus as many recent
+    // messages as fit in budget. Without a counter (no model yet) the window
+    // holds the whole history.
+    void setTokenBudget(size_t tokens, std::function<size_t(std::string_view)> counter);
     
+    std::string buildPrompt();
+    
+    // Prompt prefix as it will look once the draft is sent (for speculative prefill)
+    std::string buildDraftPrompt(std::string_view draft);
+    
+    // Rolling summary of the turns that have left the prompt window, shown to
+    // the model after the system prompt. Messages [0, summarizedCount) are in it.
+    bool hasPendingSummary() const;
+    std::string buildSummaryPrompt(size_t& upTo) const; // Folds messages [summarizedCount, upTo) in
+    bool applySummary(size_t from, size_t upTo, std::string_view text); // False if stale or empty
+    size_t getSummarizedCount() const;
+    const std::string& getSummary() const;
+
 private:
-    std::vector<Message> messages;
+    void appendSystem(std::string& prompt) const;
+    void appendTurns(std::string& prompt, size_t start) const;
+    size_t windowStart() const;
+    size_t fitWindow(size_t extraTokens);
+    size_t turnTokens(size_t index) const;
+    
+    MessageStore messages;
     std::string systemPrompt;
+    std::string summary;
+    size_t summarizedCount;
+    size_t windowBegin; // Only moves forward, in jumps (see fitWindow)
+    bool summaryInPrompt; // Off while the summary would crowd out the newest message
+    size_t tokenBudget;
+    std::function<size_t(std::string_view)> countTokens;
 };
 
@@ -0,0 +1,6 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// Appends text as a quoted, escaped JSON string
+void appendJsonString(std::string& out, std::string_view text);
@@ -1,9 +1,36 @@
 #include "llm.h"
+#include "memory.h"
 #include "llama.h"
 #include <cstring>
 #include <cstdio>
+#include <cctype>
+#include <algorithm>
+#include <cmath>
+#include <sys/stat.h>
 #include <emscripten.h>
 
+// Prompt tokens decoded per main loop step, keeps long prefills interruptible
+static const size_t kPrefillChunk = 64;
+
+// Trailing draft tokens left out of speculative prefill: the last word is
+// still being typed and BPE merges across it are not stable yet
+static const size_t kDraftTailTokens = 2;
+
+// Sequences per context: 0 is the conversation, the rest background tasks
+// and candidate scoring. The KV cache is unified, so unused ones cost nothing.
+static const int kMaxSequences = 8;
+
+// Sequence used by background tasks
+static const int kBackgroundSeq = 1;
+
+// Heap needed on top of the GGUF size: KV cache, compute buffers, token table
+static const size_t kLoadOverheadBytes = 192u * 1024 * 1024;
+
+// Context sizes tried in order when the heap is tight, and the compute
+// buffer allowance assumed next to the KV cache when picking one
+static const uint32_t kContextSizes[] = { 2048, 1024, 512 };
+static const size_t kComputeReserveBytes = 64u * 1024 * 1024;
+
 // Log to console.info instead of console.error
 #define LOG_INFO(...) do { \
     char buf[512]; \
@@ -12,27 +39,67 @@
 } while(0)
 
 LLM::LLM() : model(nullptr), ctx(nullptr), sampler(nullptr), loaded(false), generating(false), 
-             usingGPU(false), modelInfo("No model loaded"), tokensGenerated(0), maxTokens(512),
-             promptProcessed(false) {
-    // Initialize llama backend
-    llama_backend_init();
-    llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
+             usingGPU(false), modelInfo("No model loaded"), modelFingerprint(0),
+             samplerDirty(false), loadDone(false), loadCancel(false),
+             loadProgress(0.0f), loadSucceeded(false), loadInFlight(false),
+             heapTooSmall(false),
+             tokensGenerated(0), maxTokens(512), promptProcessed(false),
+             cacheKey(0), replayPos(0), replaying(false), baselineTokPerSec(0.0),
+             generationFailed(false),
+             promptCursor(0), promptEnd(0), generationStart(0.0), decodeStart(0.0), interruptTime(0.0),
+             backendReady(false), bgSampler(nullptr), bgBatch(nullptr),
+             alternativesForked(false), alternativeMaxTokens(0), altBatch(nullptr) {
+    // llama backend is initialized on first model load, keeping it off the startup path
 }
 
 LLM::~LLM() {
+    if (loadThread.joinable()) {
+        loadCancel = true;
+        loadThread.join();
+    }
+    freeModel(pendingSlot);
     unloadModel();
-    llama_backend_free();
+    if (bgSampler) {
+        llama_sampler_free(bgSampler);
+    }
+    if (bgBatch) {
+        llama_batch_free(*bgBatch);
+        delete bgBatch;
+    }
+    if (altBatch) {
+        llama_batch_free(*altBatch);
+        delete altBatch;
+    }
+    if (backendReady) {
+        llama_backend_free();
+    }
+}
+
+void LLM::ensureBackend() {
+    if (backendReady) return;
+    
+    double start = emscripten_get_now();
+    llama_backend_init();
+    llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
+    backendReady = true;
+    LOG_INFO("llama backend initialized in %.1f ms", emscripten_get_now() - start);
+}
+
+// KV cache size for n_ctx cells: K and V, f16, for every layer
+size_t LLM::estimateKVBytes(const llama_model* model, uint32_t nCtx) {
+    size_t nLayer = llama_model_n_layer(model);
+    size_t headDim = llama_model_n_embd(model) / std::max(1, llama_model_n_head(model));
+    size_t kvDim = headDim * llama_model_n_head_kv(model);
+    return (size_t)nCtx * nLayer * kvDim * 2 * sizeof(uint16_t);
 }
 
 bool LLM::isLoaded() const {
     return loaded;
 }
 
-bool LLM::loadModel(const std::string& modelPath) {
-    if (loaded) {
-        unloadModel();
-    }
-    
+// Runs on the loader thread: must not touch LLM members besides the atomics
+bool LLM::buildModel(const std::string& modelPath, const SamplerConfig& config, ModelSlot& slot,
+                     std::atomic<float>* progress, std::atomic<bool>* cancel) {
     LOG_INFO("Loading model from: %s", modelPath.c_str());
     
     // Model parameters
@@ -41,55 +108,289 @@ bool LLM::loadModel(const std::string& modelPath) {
     model_params.use_mmap = false; // Don't use mmap in browser
     model_params.use_mlock = false;
     
-    // Load model
-    model = llama_load_model_from_file(modelPath.c_str(), model_params);
-    if (!model) {
+    // Report progress to the UI and abort the load when cancel is requested
+    struct ProgressState {
+        std::atomic<float>* progress;
+        std::atomic<bool>* cancel;
+    } state = { progress, cancel };
+    
+    if (progress || cancel) {
+        model_params.progress_callback = [](float p, void* user_data) -> bool {
+            auto* st = static_cast<ProgressState*>(user_data);
+            if (st->progress) st->progress->store(p);
+            return !(st->cancel && st->cancel->load());
+        };
+        model_params.progress_callback_user_data = &state;
+    }
+    
+    // Load model (parse + copy of the weights out of MEMFS)
+    double loadStart = emscripten_get_now();
+    slot.model = llama_load_model_from_file(modelPath.c_str(), model_params);
+    if (!slot.model) {
         printf("Failed to load model\n");
         return false;
     }
     
+    if (cancel && cancel->load()) {
+        freeModel(slot);
+        return false;
+    }
+    
+    double weightsLoaded = emscripten_get_now();
+    
+    // Token ID -> text table, so decoding never calls back into the vocab
+    slot.tokenizer.build(llama_model_get_vocab(slot.model));
+    
     // Context parameters
     llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = 2048; // Context size
     ctx_params.n_batch = 512; // Batch size
     ctx_params.n_threads = 4; // Multi-threaded with pthread support!
     ctx_params.n_threads_batch = 4; // Multi-threaded for batch processing
+    // Extra sequences for background tasks and scoring; a unified KV cache lets
+    // them share the context's cells instead of splitting them per sequence
+    ctx_params.n_seq_max = kMaxSequences;
+    ctx_params.kv_unified = true;
     
-    // Create context
-    ctx = llama_new_context_with_model(model, ctx_params);
-    if (!ctx) {
+    // Create context: the KV cache and compute buffers are allocated up front,
+    // so under memory pressure a smaller context beats a failed load
+    size_t heapBefore = MemoryGovernor::sampleHeap().allocated;
+    for (uint32_t nCtx : kContextSizes) {
+        size_t kvBytes = estimateKVBytes(slot.model, nCtx);
+        bool last = nCtx == kContextSizes[sizeof(kContextSizes) / sizeof(kContextSizes[0]) - 1];
+        if (!last && kvBytes + kComputeReserveBytes > MemoryGovernor::sampleHeap().headroom) {
+            LOG_INFO("Not enough headroom for n_ctx %u (%zu MB KV cache), trying smaller", nCtx, kvBytes >> 20);
+            continue;
+        }
+        
+        ctx_params.n_ctx = nCtx;
+        slot.ctx = llama_new_context_with_model(slot.model, ctx_params);
+        if (slot.ctx) {
+            slot.memory.kvCache = kvBytes;
+            break;
+        }
+        LOG_INFO("Context creation failed at n_ctx %u", nCtx);
+    }
+    if (!slot.ctx) {
         printf("Failed to create context\n");
-        llama_free_model(model);
-        model = nullptr;
+        freeModel(slot);
         return false;
     }
     
-    // Create sampler with better settings for chat
-    sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
-    llama_sampler_chain_add(sampler, llama_sampler_init_temp(0.8f));
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(0.95f, 1));
-    llama_sampler_chain_add(sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    size_t heapAfter = MemoryGovernor::sampleHeap().allocated;
+    size_t contextBytes = heapAfter > heapBefore ? heapAfter - heapBefore : 0;
+    slot.memory.weights = llama_model_size(slot.model);
+    slot.memory.compute = contextBytes > slot.memory.kvCache ? contextBytes - slot.memory.kvCache : 0;
+    slot.memory.tokenizer = slot.tokenizer.tableBytes();
     
-    loaded = true;
+    slot.sampler = createSampler(config);
+    
+    LOG_INFO("Model ready in %.0f ms (weights %.0f ms, context %.0f ms)",
+             emscripten_get_now() - loadStart, weightsLoaded - loadStart,
+             emscripten_get_now() - weightsLoaded);
     
     // Detect if GPU is being used
     // Check if any layers were offloaded (experimental WebGPU detection)
-    usingGPU = (model_params.n_gpu_layers > 0);
+    slot.usingGPU = (model_params.n_gpu_layers > 0);
     
     // Get model info
     char buf[256];
     snprintf(buf, sizeof(buf), "llama.cpp model (ctx: %d, device: %s)", 
-             ctx_params.n_ctx, usingGPU ? "WebGPU (experimental)" : "CPU");
-    modelInfo = buf;
+             ctx_params.n_ctx, slot.usingGPU ? "WebGPU (experimental)" : "CPU");
+    slot.info = buf;
+    
+    // Identify the weights for response cache keys. Architecture and sizes
+    // alone match across fine-tunes of one base (base vs. instruct), so the
+    // GGUF's naming metadata and the exact file size go in too.
+    char desc[128];
+    llama_model_desc(slot.model, desc, sizeof(desc));
+    struct stat st;
+    uint64_t sizes[3] = { llama_model_size(slot.model), llama_model_n_params(slot.model),
+                          stat(modelPath.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0 };
+    slot.fingerprint = ResponseCache::hashBytes(desc, strlen(desc));
+    slot.fingerprint = ResponseCache::hashBytes(sizes, sizeof(sizes), slot.fingerprint);
+    static const char* kIdentityKeys[] = { "general.name", "general.basename", "general.finetune", "general.version" };
+    for (const char* key : kIdentityKeys) {
+        char value[256];
+        if (llama_model_meta_val_str(slot.model, key, value, sizeof(value)) >= 0) {
+            slot.fingerprint = ResponseCache::hashBytes(key, strlen(key), slot.fingerprint);
+            slot.fingerprint = ResponseCache::hashBytes(value, strlen(value), slot.fingerprint);
+        }
+    }
+    
+    if (progress) progress->store(1.0f);
+    return true;
+}
+
+llama_sampler* LLM::createSampler(const SamplerConfig& config) {
+    llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    
+    if (config.isGreedy()) {
+        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+        return chain;
+    }
+    
+    // Sampler with better settings for chat
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(config.temperature));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(config.topK));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(config.topP, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(config.seed));
+    return chain;
+}
+
+void LLM::freeModel(ModelSlot& slot) {
+    if (slot.sampler) {
+        llama_sampler_free(slot.sampler);
+        slot.sampler = nullptr;
+    }
     
+    if (slot.ctx) {
+        llama_free(slot.ctx);
+        slot.ctx = nullptr;
+    }
+    
+    if (slot.model) {
+        llama_free_model(slot.model);
+        slot.model = nullptr;
+    }
+}
+
+// Swap a fully built model in place of the current one (main thread only)
+void LLM::installModel(ModelSlot& slot) {
+    if (generating) {
+        stopGeneration();
+    }
+    unloadModel();
+    
+    model = slot.model;
+    ctx = slot.ctx;
+    sampler = slot.sampler;
+    usingGPU = slot.usingGPU;
+    modelInfo = slot.info;
+    modelFingerprint = slot.fingerprint;
+    modelMemory = slot.memory;
+    // Cached token IDs belong to the old vocabulary
+    committedTokens.clear();
+    draftTokens.clear();
+    tokenizer = std::move(slot.tokenizer);
+    slot = ModelSlot();
+    
+    loaded = true;
     LOG_INFO("Model loaded successfully - Running on: %s", usingGPU ? "GPU (experimental)" : "CPU");
+}
+
+// Weights are read into the wasm heap (no mmap), next to the current model
+// during a hot-swap. Refuse loads that cannot fit instead of aborting midway.
+bool LLM::checkMemoryBudget(const std::string& modelPath) {
+    heapTooSmall = false;
+    
+    struct stat st;
+    if (stat(modelPath.c_str(), &st) != 0) {
+        lastError = "Model file not found: " + modelPath;
+        return false;
+    }
+    
+    HeapStats heap = MemoryGovernor::sampleHeap();
+    size_t heapMax = heap.heapMax;
+    size_t available = heap.headroom;
+    uint64_t needed = (uint64_t)st.st_size + kLoadOverheadBytes;
+    
+    LOG_INFO("Memory budget: model %llu MB, need %llu MB, %zu MB free of %zu MB heap",
+             (unsigned long long)(st.st_size >> 20), (unsigned long long)(needed >> 20),
+             available >> 20, heapMax >> 20);
+    
+    if (needed > available) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "Not enough memory for this model: needs %llu MB, only %zu MB of the %zu MB heap is free.",
+                 (unsigned long long)(needed >> 20), available >> 20, heapMax >> 20);
+        lastError = buf;
+        heapTooSmall = true;
+        return false;
+    }
     return true;
 }
 
+bool LLM::beginLoadModel(const std::string& modelPath) {
+    if (loadInFlight) {
+        lastError = "A model is already loading. Cancel it first to load another one.";
+        return false;
+    }
+    if (!checkMemoryBudget(modelPath)) {
+        return false;
+    }
+    ensureBackend(); // On the main thread, before the loader starts
+    
+    loadInFlight = true;
+    loadDone = false;
+    loadCancel = false;
+    loadProgress = 0.0f;
+    loadSucceeded = false;
+    
+    SamplerConfig config = samplerConfig;
+    loadThread = std::thread([this, modelPath, config]() {
+        loadSucceeded = buildModel(modelPath, config, pendingSlot, &loadProgress, &loadCancel);
+        loadDone = true;
+    });
+    
+    return true;
+}
+
+void LLM::cancelModelLoad() {
+    if (loadInFlight) {
+        loadCancel = true;
+        LOG_INFO("Model load cancellation requested");
+    }
+}
+
+LoadState LLM::pollModelLoad() {
+    if (!loadInFlight) return LoadState::IDLE;
+    if (!loadDone) return LoadState::LOADING;
+    
+    if (loadThread.joinable()) {
+        loadThread.join();
+    }
+    loadInFlight = false;
+    
+    if (!loadSucceeded || loadCancel) {
+        freeModel(pendingSlot);
+        if (loadCancel) {
+            LOG_INFO("Model load cancelled");
+            return LoadState::CANCELLED;
+        }
+        return LoadState::FAILED;
+    }
+    
+    // Hot-swap: the old model keeps answering until its current reply is done
+    if (generating) {
+        loadInFlight = true;
+        return LoadState::LOADING;
+    }
+    
+    installModel(pendingSlot);
+    return LoadState::READY;
+}
+
+bool LLM::isLoadingModel() const {
+    return loadInFlight;
+}
+
+float LLM::getLoadProgress() const {
+    return loadProgress.load();
+}
+
+const std::string& LLM::getLastError() const {
+    return lastError;
+}
+
+bool LLM::lastLoadNeedsLargerHeap() const {
+    return heapTooSmall;
+}
+
 void LLM::unloadModel() {
     if (!loaded) return;
     
+    cancelBackgroundTask();
+    freeAdapters();
+    
     if (sampler) {
         llama_sampler_free(sampler);
         sampler = nullptr;
@@ -105,61 +406,47 @@ void LLM::unloadModel() {
         model = nullptr;
     }
     
+    tokenizer.clear();
+    modelMemory = ModelMemory();
     loaded = false;
     modelInfo = "No model loaded";
     LOG_INFO("Model unloaded");
 }
 
-std::vector<int> LLM::tokenize(const std::string& text, bool add_special) {
-    if (!model) return {};
-    
-    const llama_vocab* vocab = llama_model_get_vocab(model);
-    
-    int n_tokens = text.length() + (add_special ? 2 : 0);
-    std::vector<int> tokens(n_tokens);
-    
-    n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), 
-                               tokens.data(), tokens.size(), 
-                               add_special, false);
-    
-    if (n_tokens < 0) {
-        tokens.resize(-n_tokens);
-        n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), 
-                                   tokens.data(), tokens.size(), 
-                                   add_special, false);
-    }
-    
-    tokens.resize(n_tokens);
-    return tokens;
-}
-
-std::string LLM::detokenize(int token) {
-    if (!model) return "";
-    
-    const llama_vocab* vocab = llama_model_get_vocab(model);
-    
-    char buf[128];
-    int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, false);
-    
-    if (n > 0) {
-        return std::string(buf, n);
-    }
-    return "";
-}
-
 // Start generation (just setup, no processing yet)
-void LLM::startGeneration(const std::string& prompt, std::function<void(const std::string&)> onToken) {
+void LLM::startGeneration(const std::string& prompt, std::function<void(std::string_view)> onToken) {
     if (!loaded || generating) {
         printf("Cannot generate: loaded=%d, generating=%d\n", loaded, generating);
         return;
     }
     
+    // The reply needs the whole context; background work starts over later
+    cancelBackgroundTask();
+    applyAdapters();
+    
     generating = true;
+    generationFailed = false;
     promptProcessed = false;
     pendingPrompt = prompt;
     onTokenCallback = onToken;
     currentResponse = "";
     tokensGenerated = 0;
+    replaying = false;
+    recording = CachedResponse();
+    promptTokens.clear();
+    promptCursor = 0;
+    draftTokens.clear();
+    utf8Stream.reset();
+    generationStart = emscripten_get_now();
+    
+    if (samplerDirty) {
+        llama_sampler_free(sampler);
+        sampler = createSampler(samplerConfig);
+        samplerDirty = false;
+    }
+    
+    // Same seed, same stream: restart the RNG for every reply
+    llama_sampler_reset(sampler);
     
     LOG_INFO("Generation queued for prompt: %s", prompt.substr(0, 50).c_str());
 }
@@ -174,35 +461,97 @@ bool LLM::stepGeneration() {
     if (!promptProcessed) {
         LOG_INFO("Processing prompt...");
         
-        // Tokenize prompt
-        std::vector<int> tokens = tokenize(pendingPrompt, true);
+        // Tokenize prompt (into the tokenizer's reusable buffer)
+        const std::vector<int>& tokens = tokenizer.tokenize(pendingPrompt, true);
         
         if (tokens.empty()) {
-            printf("Failed to tokenize prompt\n");
-            generating = false;
+            failGeneration("Could not tokenize the prompt.");
             return false;
         }
         
         LOG_INFO("Tokenized prompt: %zu tokens", tokens.size());
         
-        // Create batch
-        llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
+        // Deterministic sampling: replay a previous reply to the same prompt
+        cacheKey = samplerConfig.isDeterministic() && alternatives.empty() ? computeCacheKey(tokens) : 0;
+        if (cacheKey) {
+            const CachedResponse* hit = responseCache.lookup(cacheKey);
+            if (hit) {
+                replay = *hit;
+                replayPos = 0;
+                replaying = true;
+                promptProcessed = true;
+                ResponseCacheStats stats = responseCache.getStats();
+                LOG_INFO("Response cache hit (%zu pieces) - hits: %llu, misses: %llu",
+                         replay.pieceCount(), (unsigned long long)stats.hits,
+                         (unsigned long long)stats.misses);
+                return true;
+            }
+            LOG_INFO("Response cache miss");
+        }
         
-        // Process prompt
-        if (llama_decode(ctx, batch) != 0) {
-            printf("Failed to decode prompt\n");
-            generating = false;
+        if (tokens.size() >= llama_n_ctx(ctx)) {
+            char buf[160];
+            snprintf(buf, sizeof(buf), "The conversation does not fit in the context (%zu of %u tokens). Clear the chat to continue.",
+                     tokens.size(), llama_n_ctx(ctx));
+            failGeneration(buf);
             return false;
         }
         
+        // Reuse the KV cache for the prefix shared with what is already decoded,
+        // and drop everything after it (stale or interrupted turns)
+        size_t reuse = commonPrefix(tokens);
+        if (reuse == tokens.size()) {
+            reuse--; // The last prompt token must be decoded again to get logits
+        }
+        truncateCommitted(reuse);
+        
+        LOG_INFO("Prompt: %zu tokens, %zu reused from KV cache, %zu to prefill",
+                 tokens.size(), reuse, tokens.size() - reuse);
+        
+        promptTokens.assign(tokens.begin(), tokens.end());
+        promptCursor = reuse;
         promptProcessed = true;
-        LOG_INFO("Prompt processed, ready to generate tokens");
+    }
+    
+    // Prefill the new part of the prompt, one chunk per step
+    if (promptCursor < promptTokens.size()) {
+        size_t n = std::min(kPrefillChunk, promptTokens.size() - promptCursor);
+        if (!decodeTokens(promptTokens.data() + promptCursor, n)) {
+            failGeneration("Failed to decode the prompt.");
+            return false;
+        }
+        promptCursor += n;
+        
+        if (promptCursor == promptTokens.size()) {
+            promptEnd = committedTokens.size();
+            decodeStart = emscripten_get_now();
+            LOG_INFO("Prompt processed in %.1f ms, ready to generate tokens",
+                     emscripten_get_now() - generationStart);
+        }
         return true; // Continue next frame
     }
     
+    if (!alternatives.empty()) {
+        return stepAlternatives();
+    }
+    
+    // Cached reply: stream one recorded piece per frame, no decode
+    if (replaying) {
+        if (replayPos >= replay.pieceCount()) {
+            finishGeneration(false);
+            return false;
+        }
+        std::string_view piece = replay.piece(replayPos++);
+        currentResponse.append(piece.data(), piece.size());
+        if (onTokenCallback) {
+            onTokenCallback(piece);
+        }
+        return true;
+    }
+    
     // Check if we've generated enough tokens
-    if (tokensGenerated >= maxTokens) {
-        generating = false;
+    if (tokensGenerated >= maxTokens || committedTokens.size() >= llama_n_ctx(ctx)) {
+        finishGeneration(true);
         LOG_INFO("Max tokens reached");
         return false;
     }
@@ -214,75 +563,765 @@ bool LLM::stepGeneration() {
     const llama_vocab* vocab = llama_model_get_vocab(model);
     if (llama_vocab_is_eog(vocab, new_token_id)) {
         LOG_INFO("EOS token detected, stopping generation");
-        generating = false;
+        finishGeneration(true);
         return false;
     }
     
-    // Detokenize
-    std::string piece = detokenize(new_token_id);
+    // Detokenize: table lookup, held back until UTF-8 characters are complete
+    std::string_view piece = utf8Stream.push(tokenizer.piece(new_token_id));
     
-    // Skip empty pieces
+    // Skip empty pieces (still decoded so the KV cache stays in sync)
     if (piece.empty()) {
+        if (!decodeTokens(&new_token_id, 1)) {
+            failGeneration("Failed to decode a token.");
+            return false;
+        }
         return true; // Continue generating
     }
     
     // Filter out any Qwen2.5 special tokens or fragments
-    if (piece.find("<|") != std::string::npos ||
-        piece.find("|>") != std::string::npos ||
-        piece.find("im_end") != std::string::npos ||
-        piece.find("im_start") != std::string::npos ||
-        piece.find("endoftext") != std::string::npos) {
-        LOG_INFO("Stop token/fragment detected: %s", piece.c_str());
-        generating = false;
+    if (piece.find("<|") != std::string_view::npos ||
+        piece.find("|>") != std::string_view::npos ||
+        piece.find("im_end") != std::string_view::npos ||
+        piece.find("im_start") != std::string_view::npos ||
+        piece.find("endoftext") != std::string_view::npos) {
+        LOG_INFO("Stop token/fragment detected: %.*s", (int)piece.size(), piece.data());
+        finishGeneration(true);
         return false;
     }
     
-    // Check for gibberish or repeated punctuation
+    // Check for gibberish or repeated punctuation. Pieces are whole UTF-8
+    // characters (Utf8Stream), so non-ASCII bytes are real text, not junk.
     bool hasValidContent = false;
-    for (char c : piece) {
-        if (std::isalnum(c) || std::isspace(c)) {
+    for (unsigned char c : piece) {
+        if (c >= 0x80 || std::isalnum(c) || std::isspace(c)) {
             hasValidContent = true;
             break;
         }
     }
     
-    // If piece is only punctuation/symbols and longer than 1 char, skip it
+    // If piece is only ASCII punctuation/symbols and longer than 1 char, skip it
     if (!hasValidContent && piece.length() > 1) {
-        LOG_INFO("Skipping gibberish/repeated symbols: %s", piece.substr(0, 10).c_str());
+        LOG_INFO("Skipping gibberish/repeated symbols: %.*s", (int)std::min<size_t>(piece.size(), 10), piece.data());
         // Prepare for next iteration (don't add to response, but continue generating)
-        llama_batch batch = llama_batch_get_one(&new_token_id, 1);
-        if (llama_decode(ctx, batch) != 0) {
-            printf("Failed to decode token\n");
-            generating = false;
+        if (!decodeTokens(&new_token_id, 1)) {
+            failGeneration("Failed to decode a token.");
             return false;
         }
         return true; // Continue generating, just skip this token
     }
     
     // Add to response
-    currentResponse += piece;
+    currentResponse.append(piece.data(), piece.size());
     tokensGenerated++;
     
+    if (cacheKey) {
+        recording.text.append(piece.data(), piece.size());
+        recording.pieceEnds.push_back((uint32_t)recording.text.size());
+    }
+    
+    if (tokensGenerated == 1) {
+        double now = emscripten_get_now();
+        LOG_INFO("First token after %.1f ms", now - generationStart);
+        if (interruptTime > 0.0) {
+            LOG_INFO("Interrupt to next token: %.1f ms", now - interruptTime);
+            interruptTime = 0.0;
+        }
+    }
+    
     // Send token to UI immediately
     if (onTokenCallback) {
         onTokenCallback(piece);
     }
     
     // Prepare for next iteration
-    llama_batch batch = llama_batch_get_one(&new_token_id, 1);
+    if (!decodeTokens(&new_token_id, 1)) {
+        failGeneration("Failed to decode a token.");
+        return false;
+    }
+    
+    return true; // Continue generating
+}
+
+// Takes effect before the next decode: steps only run from the main loop
+void LLM::stopGeneration(StopMode mode) {
+    if (!generating) return;
+    
+    interruptTime = emscripten_get_now();
+    
+    // Drop the partial reply from the KV cache; the prompt stays reusable
+    if (mode == StopMode::ROLLBACK && promptProcessed && promptCursor == promptTokens.size()) {
+        truncateCommitted(promptEnd);
+    }
+    
+    // Interrupted replies are never cached
+    finishGeneration(false);
+    LOG_INFO("Generation interrupted (%s), %zu tokens committed",
+             mode == StopMode::ROLLBACK ? "rollback" : "keep partial", committedTokens.size());
+}
+
+void LLM::prefillDraft(const std::string& promptPrefix) {
+    if (!loaded) return;
+    
+    const std::vector<int>& tokens = tokenizer.tokenize(promptPrefix, true);
+    size_t stable = tokens.size() > kDraftTailTokens ? tokens.size() - kDraftTailTokens : 0;
+    if (stable >= llama_n_ctx(ctx)) {
+        stable = 0;
+    }
+    draftTokens.assign(tokens.begin(), tokens.begin() + stable);
+}
+
+bool LLM::stepDraftPrefill() {
+    if (!loaded || generating || draftTokens.empty()) {
+        return false;
+    }
+    
+    // Trim whatever diverges from the draft (edited text, previous turn's tail)
+    size_t reuse = commonPrefix(draftTokens);
+    truncateCommitted(reuse);
+    
+    if (reuse == draftTokens.size()) {
+        LOG_INFO("Draft prefilled: %zu tokens in KV cache", committedTokens.size());
+        draftTokens.clear();
+        return false;
+    }
+    
+    cancelBackgroundTask();
+    size_t n = std::min(kPrefillChunk, draftTokens.size() - reuse);
+    if (!decodeTokens(draftTokens.data() + reuse, n)) {
+        printf("Failed to decode draft\n");
+        draftTokens.clear();
+        return false;
+    }
+    return true;
+}
+
+bool LLM::hasDraftWork() const {
+    return !draftTokens.empty();
+}
+
+void LLM::startAlternatives(const std::string& prompt, int n,
+                            std::function<void(int, std::string_view)> onToken) {
+    startGeneration(prompt, nullptr);
+    if (!generating) return;
+    
+    n = std::max(1, std::min(n, kMaxSequences));
+    onAlternativeToken = std::move(onToken);
+    alternativesForked = false;
+    alternatives.resize(n);
+    
+    // Greedy would give n identical answers: fall back to the default temperature
+    SamplerConfig config = samplerConfig;
+    if (config.isGreedy()) {
+        config.temperature = SamplerConfig().temperature;
+    }
+    for (int i = 0; i < n; i++) {
+        SamplerConfig altConfig = config;
+        if (config.seed != 0xFFFFFFFF) {
+            altConfig.seed = config.seed + i;
+        }
+        alternatives[i].seq = i;
+        alternatives[i].sampler = createSampler(altConfig);
+    }
+    
+    if (!altBatch) {
+        altBatch = new llama_batch(llama_batch_init(kMaxSequences, 0, 1));
+    }
+}
+
+// The prompt is on sequence 0 with its last logits: fork it, then decode one
+// token per live alternative per step in a single batch
+bool LLM::stepAlternatives() {
+    llama_memory_t mem = llama_get_memory(ctx);
+    
+    if (!alternativesForked) {
+        alternativesForked = true;
+        // Forked cells are shared, only the replies need room
+        int freeCells = (int)llama_n_ctx(ctx) - (int)committedTokens.size();
+        alternativeMaxTokens = std::min(maxTokens, freeCells / (int)alternatives.size());
+        for (size_t i = 0; i < alternatives.size(); i++) {
+            Alternative& alt = alternatives[i];
+            if (alt.seq != 0) {
+                llama_memory_seq_cp(mem, 0, alt.seq, -1, -1);
+            }
+            alt.pos = (int)committedTokens.size();
+            acceptAlternative(i, llama_sampler_sample(alt.sampler, ctx, -1));
+        }
+        return true;
+    }
+    
+    llama_batch& batch = *altBatch;
+    batch.n_tokens = 0;
+    for (Alternative& alt : alternatives) {
+        alt.row = -1;
+        if (alt.done) continue;
+        int n = batch.n_tokens++;
+        batch.token[n] = alt.nextToken;
+        batch.pos[n] = alt.pos;
+        batch.n_seq_id[n] = 1;
+        batch.seq_id[n][0] = alt.seq;
+        batch.logits[n] = true;
+        alt.row = n;
+    }
+    
+    if (batch.n_tokens == 0) {
+        finishGeneration(true);
+        return false;
+    }
     
-    // Decode
     if (llama_decode(ctx, batch) != 0) {
-        printf("Failed to decode token\n");
-        generating = false;
+        printf("Failed to decode alternatives\n");
+        finishGeneration(false);
         return false;
     }
     
-    return true; // Continue generating
+    for (size_t i = 0; i < alternatives.size(); i++) {
+        Alternative& alt = alternatives[i];
+        if (alt.row < 0) continue;
+        if (alt.seq == 0) {
+            committedTokens.push_back(alt.nextToken); // Sequence 0 mirrors the committed history
+        }
+        alt.pos++;
+        acceptAlternative(i, llama_sampler_sample(alt.sampler, ctx, alt.row));
+    }
+    return true;
+}
+
+void LLM::acceptAlternative(size_t index, int token) {
+    Alternative& alt = alternatives[index];
+    std::string_view raw = tokenizer.piece(token);
+    
+    if (llama_vocab_is_eog(llama_model_get_vocab(model), token) ||
+        raw.find("<|") != std::string_view::npos ||
+        alt.generated >= alternativeMaxTokens) {
+        alt.done = true;
+        return;
+    }
+    
+    alt.nextToken = token;
+    alt.generated++;
+    tokensGenerated++;
+    if (tokensGenerated == 1) {
+        decodeStart = emscripten_get_now();
+    }
+    
+    std::string_view piece = alt.utf8.push(raw);
+    if (!piece.empty() && onAlternativeToken) {
+        onAlternativeToken((int)index, piece);
+    }
+}
+
+void LLM::releaseAlternatives() {
+    if (ctx) {
+        llama_memory_t mem = llama_get_memory(ctx);
+        for (const Alternative& alt : alternatives) {
+            if (alt.seq != 0) {
+                llama_memory_seq_rm(mem, alt.seq, -1, -1);
+            }
+        }
+    }
+    for (Alternative& alt : alternatives) {
+        llama_sampler_free(alt.sampler);
+    }
+    if (alternatives.size() > 1) {
+        LOG_INFO("%zu alternatives from one prefill: %d tokens", alternatives.size(), tokensGenerated);
+    }
+    alternatives.clear();
+    onAlternativeToken = nullptr;
+    alternativesForked = false;
+}
+
+bool LLM::startBackgroundTask(const std::string& prompt, int maxTokens, std::function<void(std::string)> onDone) {
+    if (!loaded || generating || bgTask.active) {
+        return false;
+    }
+    
+    const std::vector<int>& tokens = tokenizer.tokenize(prompt, true);
+    
+    // Both sequences share the KV cells: the task must fit next to the conversation
+    if (tokens.empty() || committedTokens.size() + tokens.size() + maxTokens > llama_n_ctx(ctx)) {
+        LOG_INFO("Background task skipped: %zu prompt tokens do not fit next to %zu committed",
+                 tokens.size(), committedTokens.size());
+        return false;
+    }
+    
+    if (!bgSampler) {
+        bgSampler = llama_sampler_init_greedy();
+    }
+    if (!bgBatch) {
+        bgBatch = new llama_batch(llama_batch_init((int)kPrefillChunk, 0, 1));
+    }
+    
+    bgTask = BackgroundTask();
+    bgTask.active = true;
+    bgTask.promptTokens.assign(tokens.begin(), tokens.end());
+    bgTask.maxTokens = maxTokens;
+    bgTask.onDone = std::move(onDone);
+    bgTask.start = emscripten_get_now();
+    return true;
+}
+
+// One prefill chunk or one token per call, same granularity as the foreground
+bool LLM::stepBackgroundTask() {
+    if (!bgTask.active || generating) {
+        return false;
+    }
+    
+    if (bgTask.cursor < bgTask.promptTokens.size()) {
+        size_t n = std::min(kPrefillChunk, bgTask.promptTokens.size() - bgTask.cursor);
+        bool last = bgTask.cursor + n == bgTask.promptTokens.size();
+        if (!decodeBackground(bgTask.promptTokens.data() + bgTask.cursor, n, last)) {
+            printf("Failed to decode background prompt\n");
+            cancelBackgroundTask();
+            return false;
+        }
+        bgTask.cursor += n;
+        return true;
+    }
+    
+    int token = llama_sampler_sample(bgSampler, ctx, -1);
+    std::string_view piece = tokenizer.piece(token);
+    bool done = llama_vocab_is_eog(llama_model_get_vocab(model), token) ||
+                piece.find("<|") != std::string_view::npos ||
+                bgTask.generated >= bgTask.maxTokens;
+    
+    if (!done) {
+        bgTask.text.append(piece.data(), piece.size());
+        if (!decodeBackground(&token, 1, true)) {
+            printf("Failed to decode background token\n");
+            cancelBackgroundTask();
+            return false;
+        }
+        bgTask.generated++;
+        return true;
+    }
+    
+    LOG_INFO("Background task done: %zu prompt + %d generated tokens in %.0f ms",
+             bgTask.promptTokens.size(), bgTask.generated, emscripten_get_now() - bgTask.start);
+    
+    std::function<void(std::string)> onDone = std::move(bgTask.onDone);
+    std::string text = std::move(bgTask.text);
+    cancelBackgroundTask();
+    if (onDone) {
+        onDone(std::move(text));
+    }
+    return false;
 }
 
-void LLM::stopGeneration() {
+void LLM::cancelBackgroundTask() {
+    if (!bgTask.active) return;
+    
+    if (ctx) {
+        llama_memory_seq_rm(llama_get_memory(ctx), kBackgroundSeq, -1, -1);
+    }
+    bgTask = BackgroundTask();
+}
+
+bool LLM::hasBackgroundTask() const {
+    return bgTask.active;
+}
+
+// log(softmax(logits)[token]) over the whole vocabulary
+static float tokenLogprob(const float* logits, int nVocab, int token) {
+    float maxLogit = *std::max_element(logits, logits + nVocab);
+    double sum = 0.0;
+    for (int i = 0; i < nVocab; i++) {
+        sum += std::exp(logits[i] - maxLogit);
+    }
+    return logits[token] - maxLogit - (float)std::log(sum);
+}
+
+bool LLM::scoreCandidates(const std::string& prefix, const std::vector<std::string>& candidates,
+                          std::vector<CandidateScore>& scores) {
+    scores.clear();
+    if (!loaded || generating) {
+        lastError = loaded ? "Cannot score while generating." : "No model loaded.";
+        return false;
+    }
+    cancelBackgroundTask();
+    applyAdapters();
+    draftTokens.clear();
+    
+    double start = emscripten_get_now();
+    
+    // Copies: tokenize() reuses one buffer. Candidates are tokenized on their own,
+    // so they should carry their leading space (" yes", not "yes").
+    std::vector<int> prefixTokens = tokenizer.tokenize(prefix, true);
+    std::vector<std::vector<int>> candidateTokens;
+    size_t totalTokens = 0;
+    for (const std::string& candidate : candidates) {
+        const std::vector<int>& tokens = tokenizer.tokenize(candidate, false);
+        candidateTokens.emplace_back(tokens.begin(), tokens.end());
+        totalTokens += tokens.size() + 1;
+    }
+    
+    size_t nBatch = llama_n_batch(ctx);
+    if (prefixTokens.empty() || prefixTokens.size() + totalTokens > llama_n_ctx(ctx)) {
+        lastError = "Prefix and candidates do not fit in the context.";
+        return false;
+    }
+    for (const std::vector<int>& tokens : candidateTokens) {
+        if (tokens.empty() || tokens.size() + 1 > nBatch) {
+            lastError = "Empty or oversized candidate.";
+            return false;
+        }
+    }
+    
+    // Prefix minus its last token goes to sequence 0 (reusing the KV cache).
+    // The last token is repeated at the head of every candidate so each fork
+    // gets its own logits for the first candidate token.
+    size_t shared = prefixTokens.size() - 1;
+    size_t reuse = commonPrefix(prefixTokens);
+    truncateCommitted(std::min(reuse, shared));
+    for (size_t pos = committedTokens.size(); pos < shared; pos += kPrefillChunk) {
+        size_t n = std::min(kPrefillChunk, shared - pos);
+        if (!decodeTokens(prefixTokens.data() + pos, n)) {
+            lastError = "Failed to decode the prefix.";
+            return false;
+        }
+    }
+    
+    llama_memory_t mem = llama_get_memory(ctx);
+    int nVocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    int lastPrefixToken = prefixTokens.back();
+    llama_batch batch = llama_batch_init((int)nBatch, 0, 1);
+    scores.resize(candidates.size());
+    bool ok = true;
+    
+    // Groups bounded by the free sequences and the batch size, one decode each
+    size_t next = 0;
+    while (ok && next < candidates.size()) {
+        size_t first = next;
+        batch.n_tokens = 0;
+        while (next < candidates.size() && (int)(next - first) < kMaxSequences - 1 &&
+               batch.n_tokens + candidateTokens[next].size() + 1 <= nBatch) {
+            int seq = (int)(next - first) + 1;
+            llama_memory_seq_cp(mem, 0, seq, -1, -1);
+            
+            const std::vector<int>& tokens = candidateTokens[next];
+            for (size_t i = 0; i <= tokens.size(); i++) {
+                int n = batch.n_tokens++;
+                batch.token[n] = i == 0 ? lastPrefixToken : tokens[i - 1];
+                batch.pos[n] = (int)(shared + i);
+                batch.n_seq_id[n] = 1;
+                batch.seq_id[n][0] = seq;
+                batch.logits[n] = i < tokens.size(); // Predicts candidate token i
+            }
+            next++;
+        }
+        
+        if (llama_decode(ctx, batch) != 0) {
+            lastError = "Failed to decode candidates.";
+            ok = false;
+        } else {
+            int index = 0;
+            for (size_t c = first; c < next; c++) {
+                const std::vector<int>& tokens = candidateTokens[c];
+                CandidateScore& score = scores[c];
+                for (size_t i = 0; i < tokens.size(); i++) {
+                    float lp = tokenLogprob(llama_get_logits_ith(ctx, index + (int)i), nVocab, tokens[i]);
+                    score.tokenLogprobs.push_back(lp);
+                    score.total += lp;
+                }
+                index += (int)tokens.size() + 1;
+            }
+        }
+        
+        for (int seq = 1; seq <= (int)(next - first); seq++) {
+            llama_memory_seq_rm(mem, seq, -1, -1);
+        }
+    }
+    llama_batch_free(batch);
+    
+    if (!ok) {
+        scores.clear();
+        return false;
+    }
+    
+    double ms = emscripten_get_now() - start;
+    LOG_INFO("Scored %zu candidates (%zu tokens, %zu-token prefix, %zu reused) in %.1f ms (%.1f candidates/s)",
+             candidates.size(), totalTokens, prefixTokens.size(), std::min(reuse, shared), ms,
+             candidates.size() * 1000.0 / ms);
+    return true;
+}
+
+// Decode tokens at the end of the background sequence
+bool LLM::decodeBackground(const int* tokens, size_t count, bool wantLogits) {
+    llama_batch& batch = *bgBatch;
+    int pos = (int)bgTask.cursor + bgTask.generated;
+    for (size_t i = 0; i < count; i++) {
+        batch.token[i] = tokens[i];
+        batch.pos[i] = pos + (int)i;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = kBackgroundSeq;
+        batch.logits[i] = wantLogits && i == count - 1;
+    }
+    batch.n_tokens = (int)count;
+    return llama_decode(ctx, batch) == 0;
+}
+
+// Decode tokens at the end of sequence 0 and record them as committed
+bool LLM::decodeTokens(const int* tokens, size_t count) {
+    llama_batch batch = llama_batch_get_one(const_cast<int*>(tokens), (int)count);
+    if (llama_decode(ctx, batch) != 0) {
+        return false;
+    }
+    committedTokens.insert(committedTokens.end(), tokens, tokens + count);
+    return true;
+}
+
+size_t LLM::commonPrefix(const std::vector<int>& tokens) const {
+    size_t n = 0;
+    size_t limit = std::min(tokens.size(), committedTokens.size());
+    while (n < limit && tokens[n] == committedTokens[n]) {
+        n++;
+    }
+    return n;
+}
+
+void LLM::truncateCommitted(size_t count) {
+    if (count >= committedTokens.size()) return;
+    llama_memory_seq_rm(llama_get_memory(ctx), 0, (int)count, -1);
+    committedTokens.resize(count);
+}
+
+// completed: the reply ended on its own (EOS, stop token or token limit)
+// A reply that ended in an error: the UI shows it via takeGenerationError()
+void LLM::failGeneration(const std::string& error) {
+    printf("Generation failed: %s\n", error.c_str());
+    lastError = error;
+    generationFailed = true;
+    finishGeneration(false);
+}
+
+bool LLM::takeGenerationError(std::string& error) {
+    if (!generationFailed) return false;
+    generationFailed = false;
+    error = lastError;
+    return true;
+}
+
+void LLM::finishGeneration(bool completed) {
+    // Decode throughput, to compare with and without UI load or adapters.
+    // appliedScales is what this reply ran with (set by startGeneration), not
+    // a selection made since. Mixes are only logged: their speed says nothing
+    // about any one adapter. So are n-best RETRYs, which decode one token per
+    // alternative in each step.
+    if (generating && !replaying && tokensGenerated > 1) {
+        double ms = emscripten_get_now() - decodeStart;
+        double tokPerSec = tokensGenerated * 1000.0 / ms;
+        if (!alternatives.empty()) {
+            LOG_INFO("Decoded %d steps of %zu alternatives in %.0f ms (not sampled, baseline stays %.1f tok/s)",
+                     tokensGenerated, alternatives.size(), ms, baselineTokPerSec);
+        } else {
+            int active = 0;
+            size_t last = 0;
+            for (size_t i = 0; i < appliedScales.size(); i++) {
+                if (appliedScales[i] != 0.0f) {
+                    active++;
+                    last = i;
+                }
+            }
+            if (active == 0) {
+                baselineTokPerSec = tokPerSec;
+            } else if (active == 1) {
+                adapters[last].tokPerSec = tokPerSec;
+            }
+            LOG_INFO("Decoded %d tokens in %.0f ms (%.1f tok/s, %d adapters)", tokensGenerated, ms, tokPerSec, active);
+        }
+    }
+    
     generating = false;
+    replaying = false;
+    
+    if (!alternatives.empty()) {
+        releaseAlternatives();
+    }
+    
+    if (completed && cacheKey && !recording.pieceEnds.empty()) {
+        responseCache.insert(cacheKey, std::move(recording));
+    }
+    recording = CachedResponse();
+    cacheKey = 0;
+}
+
+uint64_t LLM::computeCacheKey(const std::vector<int>& tokens) const {
+    uint64_t h = ResponseCache::hashBytes(&modelFingerprint, sizeof(modelFingerprint));
+    
+    float floats[2] = { samplerConfig.temperature, samplerConfig.topP };
+    int32_t ints[3] = { samplerConfig.topK, (int32_t)samplerConfig.seed, maxTokens };
+    if (samplerConfig.isGreedy()) {
+        floats[0] = floats[1] = 0.0f;
+        ints[0] = ints[1] = 0;
+    }
+    h = ResponseCache::hashBytes(floats, sizeof(floats), h);
+    h = ResponseCache::hashBytes(ints, sizeof(ints), h);
+    for (const AdapterInfo& adapter : adapters) {
+        if (adapter.scale != 0.0f) {
+            h = ResponseCache::hashBytes(adapter.name.data(), adapter.name.size(), h);
+            h = ResponseCache::hashBytes(&adapter.scale, sizeof(adapter.scale), h);
+        }
+    }
+    h = ResponseCache::hashBytes(tokens.data(), tokens.size() * sizeof(int), h);
+    return h ? h : 1;
+}
+
+bool LLM::loadAdapter(const std::string& name, const std::string& path) {
+    if (!loaded || generating) {
+        lastError = loaded ? "Cannot load an adapter while generating." : "Load a base model first.";
+        return false;
+    }
+    for (const AdapterInfo& adapter : adapters) {
+        if (adapter.name == name) {
+            lastError = "Adapter already loaded: " + name;
+            return false;
+        }
+    }
+    
+    double start = emscripten_get_now();
+    size_t heapBefore = MemoryGovernor::sampleHeap().allocated;
+    llama_adapter_lora* handle = llama_adapter_lora_init(model, path.c_str());
+    if (!handle) {
+        lastError = "Failed to load adapter (not a LoRA for this model?): " + path;
+        return false;
+    }
+    
+    AdapterInfo info;
+    info.name = name;
+    size_t heapAfter = MemoryGovernor::sampleHeap().allocated;
+    info.bytes = heapAfter > heapBefore ? heapAfter - heapBefore : 0;
+    adapters.push_back(info);
+    adapterHandles.push_back(handle);
+    
+    LOG_INFO("Adapter %s loaded in %.0f ms (%zu KB)", name.c_str(), emscripten_get_now() - start, info.bytes >> 10);
+    return true;
+}
+
+bool LLM::setAdapterScale(const std::string& name, float scale) {
+    for (AdapterInfo& adapter : adapters) {
+        if (adapter.name == name) {
+            adapter.scale = scale;
+            return true;
+        }
+    }
+    lastError = "No adapter named " + name;
+    return false;
+}
+
+void LLM::disableAdapters() {
+    for (AdapterInfo& adapter : adapters) {
+        adapter.scale = 0.0f;
+    }
+}
+
+const std::vector<AdapterInfo>& LLM::getAdapters() const {
+    return adapters;
+}
+
+size_t LLM::getAdapterBytes() const {
+    size_t total = 0;
+    for (const AdapterInfo& adapter : adapters) {
+        total += adapter.bytes;
+    }
+    return total;
+}
+
+double LLM::getBaselineTokPerSec() const {
+    return baselineTokPerSec;
+}
+
+// Hand the requested selection to the context if it changed. KV entries
+// computed under other adapters are stale, so the cache starts over.
+void LLM::applyAdapters() {
+    std::vector<float> scales(adapters.size());
+    for (size_t i = 0; i < adapters.size(); i++) {
+        scales[i] = adapters[i].scale;
+    }
+    bool anyActive = std::any_of(scales.begin(), scales.end(), [](float s) { return s != 0.0f; });
+    if (scales == appliedScales || (!anyActive && appliedScales.empty())) {
+        return;
+    }
+    
+    double start = emscripten_get_now();
+    llama_clear_adapter_lora(ctx);
+    int active = 0;
+    for (size_t i = 0; i < adapters.size(); i++) {
+        if (scales[i] != 0.0f) {
+            llama_set_adapter_lora(ctx, adapterHandles[i], scales[i]);
+            active++;
+        }
+    }
+    appliedScales = anyActive ? scales : std::vector<float>();
+    
+    llama_memory_clear(llama_get_memory(ctx), true);
+    committedTokens.clear();
+    draftTokens.clear();
+    LOG_INFO("Adapters switched in %.2f ms (%d active)", emscripten_get_now() - start, active);
+}
+
+void LLM::freeAdapters() {
+    if (adapters.empty()) return;
+    
+    if (ctx) {
+        llama_clear_adapter_lora(ctx);
+    }
+    for (llama_adapter_lora* handle : adapterHandles) {
+        llama_adapter_lora_free(handle);
+    }
+    LOG_INFO("%zu adapters freed with the model", adapters.size());
+    adapters.clear();
+    adapterHandles.clear();
+    appliedScales.clear();
+}
+
+void LLM::setSamplerConfig(const SamplerConfig& config) {
+    samplerConfig = config;
+    samplerDirty = true; // Rebuilt by the next startGeneration()
+}
+
+const SamplerConfig& LLM::getSamplerConfig() const {
+    return samplerConfig;
+}
+
+ResponseCache& LLM::getResponseCache() {
+    return responseCache;
+}
+
+llama_context* LLM::getContext() const {
+    return ctx;
+}
+
+const llama_vocab* LLM::getVocab() const {
+    return model ? llama_model_get_vocab(model) : nullptr;
+}
+
+const Tokenizer& LLM::getTokenizer() const {
+    return tokenizer;
+}
+
+ModelMemory LLM::getMemoryUsage() const {
+    return modelMemory;
+}
+
+size_t LLM::getPromptBudget() const {
+    return loaded ? llama_n_ctx(ctx) * 3 / 4 : 0;
+}
+
+size_t LLM::countTokens(std::string_view text) const {
+    return loaded ? tokenizer.tokenize(text, false).size() : text.size() / 4;
+}
+
+int LLM::getMaxSequences() const {
+    return kMaxSequences;
+}
+
+void LLM::clearKVCache() {
+    if (!loaded) return;
+    
+    cancelBackgroundTask();
+    llama_memory_clear(llama_get_memory(ctx), true);
+    committedTokens.clear();
+    draftTokens.clear();
 }
 
 bool LLM::isGenerating() const {
@@ -1,12 +1,69 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <functional>
 #include <vector>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include "response_cache.h"
+#include "tokenizer.h"
 
 // Forward declarations for llama.cpp types
 struct llama_model;
 struct llama_context;
 struct llama_sampler;
+struct llama_batch;
+struct llama_vocab;
+struct llama_adapter_lora;
+
+// State of a background model load started with beginLoadModel()
+enum class LoadState {
+    IDLE,
+    LOADING,
+    READY,
+    FAILED,
+    CANCELLED
+};
+
+// Sampling settings; a fixed seed or greedy decoding makes replies reproducible
+struct SamplerConfig {
+    float temperature = 0.8f;
+    int topK = 40;
+    float topP = 0.95f;
+    uint32_t seed = 0xFFFFFFFF; // LLAMA_DEFAULT_SEED: random per run
+    
+    bool isGreedy() const { return temperature <= 0.0f; }
+    bool isDeterministic() const { return isGreedy() || seed != 0xFFFFFFFF; }
+};
+
+// Log-likelihood of one candidate continuation, natural log
+struct CandidateScore {
+    std::vector<float> tokenLogprobs;
+    float total = 0.0f;
+};
+
+// Heap held by the loaded model, measured when its context was created
+struct ModelMemory {
+    size_t weights = 0;
+    size_t kvCache = 0;  // Estimated from the model shape and n_ctx
+    size_t compute = 0;  // Context allocation minus the KV cache
+    size_t tokenizer = 0;
+};
+
+// A LoRA adapter loaded against the current base model
+struct AdapterInfo {
+    std::string name;
+    size_t bytes = 0;       // Heap growth while loading it
+    float scale = 0.0f;     // Used by the next request; 0 = inactive
+    double tokPerSec = 0.0; // Decode speed of the last reply it ran in alone
+};
+
+// What happens to the partial reply in the KV cache when generation is interrupted
+enum class StopMode {
+    KEEP_PARTIAL, // Keep it as committed history (the UI keeps the partial text)
+    ROLLBACK      // Roll the KV cache back to the end of the prompt
+};
 
 class LLM {
 public:
@@ -14,22 +71,121 @@ public:
     ~LLM();
     
     bool isLoaded() const;
-    bool loadModel(const std::string& modelPath);
     void unloadModel();
     
+    // Async model loading: parses the GGUF on a worker thread while the
+    // current model (if any) keeps serving. The new model is swapped in
+    // by pollModelLoad() once it is ready and no generation is running.
+    bool beginLoadModel(const std::string& modelPath);
+    void cancelModelLoad();
+    LoadState pollModelLoad(); // Call every frame, returns READY/FAILED/CANCELLED once
+    bool isLoadingModel() const;
+    float getLoadProgress() const;
+    
+    // Why the last beginLoadModel/scoreCandidates/loadAdapter call was refused
+    const std::string& getLastError() const;
+    bool lastLoadNeedsLargerHeap() const; // Refused by the memory budget check
+    
     // Start generation (non-blocking setup)
-    void startGeneration(const std::string& prompt, std::function<void(const std::string&)> onToken);
+    void startGeneration(const std::string& prompt, std::function<void(std::string_view)> onToken);
     
     // Process next token (call this in main loop)
     bool stepGeneration();
     
-    void stopGeneration();
+    void stopGeneration(StopMode mode = StopMode::KEEP_PARTIAL);
+    
+    // N-best: prefill the prompt once, fork the KV cache into n sequences and
+    // sample all n replies (different seeds) in one batched decode per step.
+    // Stepped by stepGeneration(); onToken gets the alternative's index.
+    // Alternative 0 lives on sequence 0 and becomes the committed history.
+    void startAlternatives(const std::string& prompt, int n,
+                           std::function<void(int, std::string_view)> onToken);
+    
+    // Speculative prefill: decode the stable part of a prompt prefix (e.g. the
+    // message being typed) into the KV cache ahead of time. Runs in chunks
+    // from the main loop while idle; startGeneration() reuses whatever matches.
+    void prefillDraft(const std::string& promptPrefix);
+    bool stepDraftPrefill(); // Returns true while there is draft work left
+    bool hasDraftWork() const;
+    
+    // Low-priority background generation on a second sequence of the same
+    // context (e.g. summarizing old turns). Greedy, one token per step; the
+    // main loop only steps it while the foreground is idle, and foreground
+    // work (startGeneration, draft prefill) aborts it. onDone gets the text.
+    bool startBackgroundTask(const std::string& prompt, int maxTokens, std::function<void(std::string)> onDone);
+    bool stepBackgroundTask(); // Returns true while the task is running
+    void cancelBackgroundTask();
+    bool hasBackgroundTask() const;
+    
+    // Score candidate continuations of a shared prefix (classification,
+    // reranking). The prefix is decoded once on sequence 0, forked to one
+    // sequence per candidate, and candidates go through one batched decode
+    // per group. Blocking; refused while generating.
+    bool scoreCandidates(const std::string& prefix, const std::vector<std::string>& candidates,
+                         std::vector<CandidateScore>& scores);
     
     bool isGenerating() const;
+    
+    // True once after a reply ended in an error (prompt too long, decode
+    // failure); error is the message to show in its place
+    bool takeGenerationError(std::string& error);
+    
+    // LoRA adapters: loaded once against the base model and freed with it,
+    // then enabled or scaled per request. A new selection is applied by the
+    // next startGeneration()/scoreCandidates(); it drops the KV cache but
+    // reloads nothing.
+    bool loadAdapter(const std::string& name, const std::string& path);
+    bool setAdapterScale(const std::string& name, float scale); // 0 disables
+    void disableAdapters();
+    const std::vector<AdapterInfo>& getAdapters() const;
+    size_t getAdapterBytes() const;
+    double getBaselineTokPerSec() const; // Last reply with no adapter active
+    
+    void setSamplerConfig(const SamplerConfig& config);
+    const SamplerConfig& getSamplerConfig() const;
+    
+    // Replies to repeated prompts are replayed from here when sampling is deterministic
+    ResponseCache& getResponseCache();
+    
+    // Raw access for batch tools built on top of LLM (batch.cpp). They may use
+    // sequences 1..getMaxSequences()-1 while nothing else is running.
+    llama_context* getContext() const;
+    const llama_vocab* getVocab() const;
+    const Tokenizer& getTokenizer() const;
+    int getMaxSequences() const;
+    void clearKVCache(); // Drops every sequence, including the conversation's
+    static llama_sampler* createSampler(const SamplerConfig& config);
+    
+    ModelMemory getMemoryUsage() const;
     std::string getModelInfo() const;
-    bool isUsingGPU() const;
     
+    // For prompt builders: the share of n_ctx a prompt may take (the rest is
+    // left for the reply), and token counts without special tokens
+    size_t getPromptBudget() const;
+    size_t countTokens(std::string_view text) const;
+    bool isUsingGPU() const;
+
 private:
+    // Everything a loaded model owns, built off the main thread before swap
+    struct ModelSlot {
+        llama_model* model = nullptr;
+        llama_context* ctx = nullptr;
+        llama_sampler* sampler = nullptr;
+        bool usingGPU = false;
+        std::string info;
+        uint64_t fingerprint = 0;
+        ModelMemory memory;
+        Tokenizer tokenizer;
+    };
+    
+    static bool buildModel(const std::string& modelPath, const SamplerConfig& config, ModelSlot& slot,
+                           std::atomic<float>* progress, std::atomic<bool>* cancel);
+    static void freeModel(ModelSlot& slot);
+    static size_t estimateKVBytes(const llama_model* model, uint32_t nCtx);
+    void installModel(ModelSlot& slot);
+    bool checkMemoryBudget(const std::string& modelPath);
+    void ensureBackend();
+    
     llama_model* model;
     llama_context* ctx;
     llama_sampler* sampler;
@@ -38,16 +194,110 @@ private:
     bool generating;
     bool usingGPU;
     std::string modelInfo;
+    uint64_t modelFingerprint;
+    ModelMemory modelMemory;
+    SamplerConfig samplerConfig;
+    bool samplerDirty;
+    
+    // Background load state (worker writes pendingSlot, then sets loadDone)
+    std::thread loadThread;
+    std::atomic<bool> loadDone;
+    std::atomic<bool> loadCancel;
+    std::atomic<float> loadProgress;
+    bool loadSucceeded;
+    bool loadInFlight;
+    bool heapTooSmall;
+    std::string lastError;
+    ModelSlot pendingSlot;
     
     // Generation state
-    std::function<void(const std::string&)> onTokenCallback;
+    std::function<void(std::string_view)> onTokenCallback;
     std::string currentResponse;
     std::string pendingPrompt;
     int tokensGenerated;
     int maxTokens;
     bool promptProcessed;
     
-    std::vector<int> tokenize(const std::string& text, bool add_special);
-    std::string detokenize(int token);
+    // Response cache: key of the running prompt, reply being recorded or replayed
+    ResponseCache responseCache;
+    uint64_t cacheKey;
+    CachedResponse recording;
+    CachedResponse replay;
+    size_t replayPos;
+    bool replaying;
+    
+    uint64_t computeCacheKey(const std::vector<int>& tokens) const;
+    
+    // Adapters: handles parallel to adapters, scales the context was last given
+    std::vector<AdapterInfo> adapters;
+    std::vector<llama_adapter_lora*> adapterHandles;
+    std::vector<float> appliedScales;
+    double baselineTokPerSec;
+    
+    void applyAdapters();
+    void freeAdapters();
+    
+    bool generationFailed; // Until takeGenerationError()
+    void failGeneration(const std::string& error);
+    void finishGeneration(bool completed);
+    
+    // KV cache bookkeeping: committedTokens mirrors sequence 0 position by position,
+    // so the next prompt only prefills what differs from it
+    std::vector<int> committedTokens;
+    std::vector<int> promptTokens;
+    size_t promptCursor; // Next prompt token to prefill
+    size_t promptEnd;    // Committed size once the prompt is decoded
+    double generationStart;
+    double decodeStart;
+    double interruptTime; // Set by stopGeneration(), reported at the next first token
+    
+    bool backendReady;
+    
+    std::vector<int> draftTokens; // Target of the speculative prefill
+    
+    // Background task on sequence 1, positions counted from 0
+    struct BackgroundTask {
+        bool active = false;
+        std::vector<int> promptTokens;
+        size_t cursor = 0;
+        int maxTokens = 0;
+        int generated = 0;
+        std::string text;
+        std::function<void(std::string)> onDone;
+        double start = 0.0;
+    };
+    BackgroundTask bgTask;
+    llama_sampler* bgSampler;
+    llama_batch* bgBatch;
+    
+    bool decodeBackground(const int* tokens, size_t count, bool wantLogits);
+    
+    // N-best state: one entry per alternative, forked once the prompt is decoded
+    struct Alternative {
+        int seq = 0;
+        llama_sampler* sampler = nullptr;
+        Utf8Stream utf8;
+        int pos = 0;         // Position of nextToken
+        int nextToken = -1;  // Sampled, decoded on the next step
+        int row = -1;        // Batch row holding its logits
+        int generated = 0;
+        bool done = false;
+    };
+    std::vector<Alternative> alternatives;
+    std::function<void(int, std::string_view)> onAlternativeToken;
+    bool alternativesForked;
+    int alternativeMaxTokens;
+    llama_batch* altBatch;
+    
+    bool stepAlternatives();
+    void acceptAlternative(size_t index, int token);
+    void releaseAlternatives();
+    
+    bool decodeTokens(const int* tokens, size_t count);
+    size_t commonPrefix(const std::vector<int>& tokens) const;
+    void truncateCommitted(size_t count);
+    
+    // Piece table for the loaded model, and UTF-8 reassembly of streamed pieces
+    Tokenizer tokenizer;
+    Utf8Stream utf8Stream;
 };
-
@@ -4,10 +4,17 @@
 #include "chat.h"
 #include "llm.h"
 #include "ui.h"
+#include "batch.h"
+#include "memory.h"
+#include "json.h"
 #include <SDL2/SDL.h>
 #include <SDL_opengles2.h>
 #include <emscripten.h>
 #include <emscripten/html5.h>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
 
 // Global state
 struct AppState {
@@ -16,49 +23,372 @@ struct AppState {
     ChatSession chatSession;
     LLM llm;
     UI* ui;
+    BatchRunner* batch;
+    MemoryGovernor memory;
     bool running;
 };
 
 static AppState g_app;
 
+// Frame scheduling: only draw when there is input, animation or new content,
+// so the main thread is free for inference the rest of the time
+static const int kSettleFrames = 4;             // Frames drawn after input so ImGui can react
+static const double kStreamFrameMs = 50.0;      // Token arrivals coalesced to 20 fps
+static const double kAnimationFrameMs = 100.0;  // Loading dots / progress bar at 10 fps
+static const int kIdleSwapInterval = 6;         // Idle: poll input every 6th vsync (~10 Hz)
+static const double kStatsIntervalMs = 5000.0;
+static const double kMemoryCheckMs = 1000.0;
+static const double kCacheFlushMs = 30000.0;
+static const size_t kHistoryTrimBytes = 4u * 1024 * 1024; // Smaller histories are not worth trimming
+
+struct FrameScheduler {
+    int settleFrames = kSettleFrames;
+    double lastFrame = 0.0;
+    int swapInterval = 1;
+    
+    // Instrumentation: loop ticks vs frames actually drawn
+    double statsStart = 0.0;
+    int ticks = 0;
+    int frames = 0;
+    size_t allocations = 0;
+};
+
+static FrameScheduler g_frames;
+
+// Placeholder added by showLoadingMessage(). A hot-swap runs while the user
+// keeps chatting, so it is found by index (checked against its text), not
+// assumed to be the last message.
+static const char* kLoadingMessage = "Loading Qwen2.5-0.5B model... This may take a moment...";
+static size_t g_loadingMessage = SIZE_MAX;
+
+static void removeLoadingMessage() {
+    const MessageStore& messages = g_app.chatSession.getMessages();
+    if (g_loadingMessage < messages.size() && messages[g_loadingMessage].content == kLoadingMessage) {
+        g_app.chatSession.removeMessage(g_loadingMessage);
+    }
+    g_loadingMessage = SIZE_MAX;
+}
+
+// The GGUF copy in MEMFS is only needed while the worker parses it
+static void removeModelFile() {
+    remove("/models/model.gguf");
+}
+
+static void updateMemoryUsage() {
+    ModelMemory model = g_app.llm.getMemoryUsage();
+    MemoryGovernor& memory = g_app.memory;
+    memory.setUsage(MemorySubsystem::WEIGHTS, model.weights);
+    memory.setUsage(MemorySubsystem::KV_CACHE, model.kvCache);
+    memory.setUsage(MemorySubsystem::COMPUTE, model.compute);
+    memory.setUsage(MemorySubsystem::TOKENIZER, model.tokenizer);
+    memory.setUsage(MemorySubsystem::ADAPTERS, g_app.llm.getAdapterBytes());
+    memory.setUsage(MemorySubsystem::CHAT_HISTORY, g_app.chatSession.getMessages().bytesReserved());
+    memory.setUsage(MemorySubsystem::RESPONSE_CACHE, g_app.llm.getResponseCache().getStats().bytes);
+    memory.setUsage(MemorySubsystem::UI, MemoryGovernor::getImGuiBytes());
+}
+
+// Degrade instead of running into the heap ceiling. The KV cache and weights
+// are fixed-size once loaded, so what can be given back is caches, old
+// history and background work; a smaller n_ctx is picked at the next load.
+static void relieveMemoryPressure(MemoryPressure pressure) {
+    if (pressure == MemoryPressure::NORMAL) return;
+    
+    ResponseCache& cache = g_app.llm.getResponseCache();
+    if (cache.getStats().entries > 0) {
+        printf("Memory pressure: dropping %zu cached replies\n", cache.getStats().entries);
+        cache.clear();
+    }
+    
+    if (pressure != MemoryPressure::CRITICAL) return;
+    g_app.llm.cancelBackgroundTask();
+    
+    // Scrollback is the user's, so it goes last, only when large, and only up
+    // to what the summary covers. History indices must not shift under a
+    // reply being streamed.
+    size_t before = g_app.chatSession.getMessages().bytesReserved();
+    if (before > kHistoryTrimBytes && !g_app.llm.isGenerating() && g_app.ui->isIdle()) {
+        g_app.chatSession.trimHistory();
+        size_t after = g_app.chatSession.getMessages().bytesReserved();
+        if (after < before) {
+            printf("Memory pressure: trimmed summarized chat history, %zu KB freed\n", (before - after) >> 10);
+        }
+    }
+}
+
+static void checkMemory(double now) {
+    static double lastCheck = 0.0;
+    if (now - lastCheck < kMemoryCheckMs) return;
+    lastCheck = now;
+    
+    updateMemoryUsage();
+    MemoryPressure pressure = g_app.memory.update();
+    
+    // Otherwise the summary cancelled below would restart on the next idle tick
+    g_app.ui->setBackgroundPaused(pressure == MemoryPressure::CRITICAL);
+    relieveMemoryPressure(pressure);
+}
+
+// Persisted replies not yet written by the cache itself go out while idle
+static void flushResponseCacheWhenIdle(double now) {
+    static double lastFlush = 0.0;
+    if (now - lastFlush < kCacheFlushMs || !g_app.ui->isIdle()) return;
+    lastFlush = now;
+    
+    g_app.llm.getResponseCache().flush();
+}
+
 // C functions to be called from JavaScript
 extern "C" {
     EMSCRIPTEN_KEEPALIVE
     void showLoadingMessage() {
-        g_app.chatSession.addMessage(MessageRole::ASSISTANT, 
-            "Loading Qwen2.5-0.5B model... This may take a moment...");
+        removeLoadingMessage();
+        g_loadingMessage = g_app.chatSession.getMessages().size();
+        g_app.chatSession.addMessage(MessageRole::ASSISTANT, kLoadingMessage);
     }
     
     EMSCRIPTEN_KEEPALIVE
     void loadModelFromFS() {
         printf("Loading model from filesystem...\n");
         
-        // Remove the loading message
-        auto& messages = const_cast<std::vector<Message>&>(g_app.chatSession.getMessages());
-        if (!messages.empty() && messages.back().content.find("Loading Qwen") != std::string::npos) {
-            messages.pop_back();
+        // Parse and upload on a worker thread; the main loop picks up the result
+        if (!g_app.llm.beginLoadModel("/models/model.gguf")) {
+            // An in-flight load may still be reading the file
+            if (!g_app.llm.isLoadingModel()) {
+                removeModelFile();
+            }
+            removeLoadingMessage();
+            g_app.chatSession.addMessage(MessageRole::ASSISTANT, g_app.llm.getLastError());
+            
+            // The wasm32 heap stops at 2GB: offer the memory64 build if the browser has it
+            if (g_app.llm.lastLoadNeedsLargerHeap() && sizeof(void*) == 4) {
+                EM_ASM({
+                    if (typeof window.offerMemory64 === 'function') {
+                        window.offerMemory64();
+                    }
+                });
+            }
+        }
+    }
+    
+    // temperature <= 0 selects greedy decoding, seed < 0 a random seed per run.
+    // Both greedy and fixed-seed sampling make replies cacheable.
+    EMSCRIPTEN_KEEPALIVE
+    void configureSampling(float temperature, int seed) {
+        SamplerConfig config = g_app.llm.getSamplerConfig();
+        config.temperature = temperature;
+        config.seed = seed < 0 ? 0xFFFFFFFF : (uint32_t)seed;
+        g_app.llm.setSamplerConfig(config);
+    }
+    
+    EMSCRIPTEN_KEEPALIVE
+    void setResponseCachePersistent(int enabled) {
+        g_app.llm.getResponseCache().flush();
+        g_app.llm.getResponseCache().setPersistent(enabled ? "wasm-llm-response-cache" : "");
+    }
+    
+    // Called by the page on pagehide so batched inserts are not lost
+    EMSCRIPTEN_KEEPALIVE
+    void flushResponseCache() {
+        g_app.llm.getResponseCache().flush();
+    }
+    
+    // LoRA adapter written by the page to /adapters/<name>.gguf. Once loaded it
+    // lives in the heap, so the MEMFS copy is dropped like the model's.
+    EMSCRIPTEN_KEEPALIVE
+    int loadAdapterFromFS(const char* name) {
+        std::string path = std::string("/adapters/") + name + ".gguf";
+        bool ok = !g_app.batch->isRunning() && g_app.llm.loadAdapter(name, path);
+        remove(path.c_str());
+        if (!ok) {
+            printf("Adapter not loaded: %s\n", g_app.batch->isRunning()
+                   ? "a batch run is in progress" : g_app.llm.getLastError().c_str());
+            return 0;
+        }
+        return 1;
+    }
+    
+    // Used from the next reply on; scale 0 turns the adapter off. Several
+    // adapters can be active at once, each with its own scale.
+    EMSCRIPTEN_KEEPALIVE
+    int selectAdapter(const char* name, float scale) {
+        return g_app.llm.setAdapterScale(name, scale) ? 1 : 0;
+    }
+    
+    EMSCRIPTEN_KEEPALIVE
+    void disableAdapters() {
+        g_app.llm.disableAdapters();
+    }
+    
+    // Loaded adapters as JSON, valid until the next call. slowdown is the
+    // baseline decode speed over the speed of the last reply the adapter ran
+    // in alone (0 until both have been measured).
+    EMSCRIPTEN_KEEPALIVE
+    const char* getAdapterReport() {
+        static std::string json;
+        char buf[256];
+        double baseline = g_app.llm.getBaselineTokPerSec();
+        snprintf(buf, sizeof(buf), "{\"baselineTokPerSec\":%.2f,\"adapters\":[", baseline);
+        json = buf;
+        bool first = true;
+        for (const AdapterInfo& adapter : g_app.llm.getAdapters()) {
+            double slowdown = baseline > 0.0 && adapter.tokPerSec > 0.0 ? baseline / adapter.tokPerSec : 0.0;
+            json += first ? "{\"name\":" : ",{\"name\":";
+            appendJsonString(json, adapter.name);
+            snprintf(buf, sizeof(buf), ",\"bytes\":%zu,\"scale\":%.3f,\"tokPerSec\":%.2f,\"slowdown\":%.3f}",
+                     adapter.bytes, adapter.scale, adapter.tokPerSec, slowdown);
+            json += buf;
+            first = false;
+        }
+        json += "]}";
+        return json.c_str();
+    }
+    
+    // Per-subsystem usage and heap state as JSON, valid until the next call
+    EMSCRIPTEN_KEEPALIVE
+    const char* getMemoryReport() {
+        static std::string json;
+        updateMemoryUsage();
+        g_app.memory.update();
+        json = g_app.memory.toJson();
+        return json.c_str();
+    }
+    
+    // Deterministic stress run: allocates (and touches) blockMB blocks until the
+    // governor reports CRITICAL or malloc fails, relieving pressure at every
+    // step like the main loop does, then frees them. Returns the block count.
+    // The wasm heap stays grown afterwards; the blocks become free space in it.
+    EMSCRIPTEN_KEEPALIVE
+    int memoryStressTest(int blockMB) {
+        size_t blockBytes = (size_t)std::max(1, blockMB) << 20;
+        std::vector<void*> blocks;
+        MemoryPressure pressure = g_app.memory.update();
+        
+        while (pressure != MemoryPressure::CRITICAL) {
+            void* block = malloc(blockBytes);
+            if (!block) {
+                printf("Stress: malloc failed after %zu blocks\n", blocks.size());
+                break;
+            }
+            memset(block, 0xA5, blockBytes);
+            blocks.push_back(block);
+            
+            updateMemoryUsage();
+            pressure = g_app.memory.update();
+            relieveMemoryPressure(pressure);
+            const HeapStats& heap = g_app.memory.getHeap();
+            printf("Stress: %zu MB allocated, %zu MB headroom, pressure %s\n",
+                   (blocks.size() * blockBytes) >> 20, heap.headroom >> 20, getPressureLabel(pressure));
         }
         
-        if (g_app.llm.loadModel("/models/model.gguf")) {
+        int count = (int)blocks.size();
+        for (void* block : blocks) {
+            free(block);
+        }
+        g_app.memory.update();
+        printf("Stress: freed %d blocks, %s\n", count, g_app.memory.toJson().c_str());
+        return count;
+    }
+    
+    // Headless JSONL batch run; paths are usually under /batch (IDBFS, see shell.html).
+    // Rerunning with the same output file resumes where it stopped.
+    EMSCRIPTEN_KEEPALIVE
+    int startBatch(const char* inputPath, const char* outputPath) {
+        if (!g_app.batch->start(inputPath, outputPath)) {
+            printf("Batch not started: %s\n", g_app.batch->getLastError().c_str());
+            return 0;
+        }
+        return 1;
+    }
+    
+    EMSCRIPTEN_KEEPALIVE
+    void cancelBatch() {
+        g_app.batch->cancel();
+    }
+    
+    // Candidates are newline-separated. Returns JSON, valid until the next call:
+    // {"ok":true,"ms":..,"candidatesPerSec":..,"scores":[{"total":..,"tokens":[..]},..]}
+    // or {"ok":false,"error":".."}
+    EMSCRIPTEN_KEEPALIVE
+    const char* scoreCandidates(const char* prefix, const char* candidates) {
+        static std::string json;
+        
+        std::vector<std::string> list;
+        std::string_view rest = candidates;
+        while (!rest.empty()) {
+            size_t end = rest.find('\n');
+            list.emplace_back(rest.substr(0, end));
+            rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+        }
+        
+        std::vector<CandidateScore> scores;
+        double start = emscripten_get_now();
+        if (g_app.batch->isRunning()) {
+            json = "{\"ok\":false,\"error\":\"A batch run is in progress.\"}";
+            return json.c_str();
+        }
+        if (!g_app.llm.scoreCandidates(prefix, list, scores)) {
+            json = "{\"ok\":false,\"error\":";
+            appendJsonString(json, g_app.llm.getLastError());
+            json += "}";
+            return json.c_str();
+        }
+        double ms = emscripten_get_now() - start;
+        
+        char buf[64];
+        snprintf(buf, sizeof(buf), "{\"ok\":true,\"ms\":%.1f,\"candidatesPerSec\":%.1f,\"scores\":[",
+                 ms, scores.size() * 1000.0 / ms);
+        json = buf;
+        for (size_t i = 0; i < scores.size(); i++) {
+            snprintf(buf, sizeof(buf), "%s{\"total\":%.4f,\"tokens\":[", i ? "," : "", scores[i].total);
+            json += buf;
+            for (size_t t = 0; t < scores[i].tokenLogprobs.size(); t++) {
+                snprintf(buf, sizeof(buf), "%s%.4f", t ? "," : "", scores[i].tokenLogprobs[t]);
+                json += buf;
+            }
+            json += "]}";
+        }
+        json += "]}";
+        return json.c_str();
+    }
+}
+
+static void handleModelLoad() {
+    LoadState state = g_app.llm.pollModelLoad();
+    
+    // Loaded or not, the worker is done with the GGUF copy held by MEMFS
+    if (state == LoadState::READY || state == LoadState::FAILED || state == LoadState::CANCELLED) {
+        removeModelFile();
+    }
+    
+    switch (state) {
+        case LoadState::READY:
+            // n_ctx and the vocabulary may differ from the previous model's
+            g_app.chatSession.setTokenBudget(g_app.llm.getPromptBudget(), [](std::string_view text) {
+                return g_app.llm.countTokens(text);
+            });
+            removeLoadingMessage();
             g_app.chatSession.addMessage(MessageRole::ASSISTANT, 
                 "Model loaded successfully! You can now chat with me.");
-        } else {
+            break;
+        case LoadState::FAILED:
+            removeLoadingMessage();
             g_app.chatSession.addMessage(MessageRole::ASSISTANT, 
                 "Failed to load model. Please check the console for errors.");
-        }
+            break;
+        case LoadState::CANCELLED:
+            removeLoadingMessage();
+            g_app.chatSession.addMessage(MessageRole::ASSISTANT,
+                g_app.llm.isLoaded() ? "Model load cancelled. The current model is still active."
+                                     : "Model load cancelled.");
+            break;
+        default:
+            break;
     }
 }
 
-void main_loop() {
-    SDL_Event event;
-    while (SDL_PollEvent(&event)) {
-        ImGui_ImplSDL2_ProcessEvent(&event);
-        if (event.type == SDL_QUIT) {
-            g_app.running = false;
-        }
-    }
-    
+static void renderFrame() {
     // Start ImGui frame
+    MemoryGovernor::beginFrame();
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplSDL2_NewFrame();
     ImGui::NewFrame();
@@ -68,23 +398,120 @@ void main_loop() {
     
     // Rendering
     ImGui::Render();
+    g_frames.allocations += MemoryGovernor::endFrame();
     SDL_GL_MakeCurrent(g_app.window, g_app.gl_context);
     glViewport(0, 0, (int)ImGui::GetIO().DisplaySize.x, (int)ImGui::GetIO().DisplaySize.y);
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
     SDL_GL_SwapWindow(g_app.window);
+}
+
+static bool shouldRenderFrame(bool hadInput, double now) {
+    if (hadInput) {
+        g_frames.settleFrames = kSettleFrames;
+    }
+    if (g_frames.settleFrames > 0) {
+        g_frames.settleFrames--;
+        return true;
+    }
     
-    // AFTER rendering, handle pending generation (just queues it)
-    bool justStarted = false;
-    if (g_app.ui->processPendingGeneration()) {
-        justStarted = true;
+    double elapsed = now - g_frames.lastFrame;
+    if (g_app.ui->needsRedraw() && elapsed >= kStreamFrameMs) {
+        return true;
+    }
+    return g_app.ui->isAnimating() && elapsed >= kAnimationFrameMs;
+}
+
+// Full rate while anything is happening, slow input polling when idle
+static void updateLoopTiming(bool busy) {
+    int interval = busy ? 1 : kIdleSwapInterval;
+    if (interval != g_frames.swapInterval) {
+        g_frames.swapInterval = interval;
+        emscripten_set_main_loop_timing(EM_TIMING_RAF, interval);
     }
+}
+
+static void reportFrameStats(double now) {
+    g_frames.ticks++;
+    if (now - g_frames.statsStart < kStatsIntervalMs) return;
     
-    // Process one token per frame if generating (but not on the frame we just started)
-    if (g_app.llm.isGenerating() && !justStarted) {
-        g_app.llm.stepGeneration();
+    double seconds = (now - g_frames.statsStart) / 1000.0;
+    if (g_frames.frames > 0) {
+        printf("UI: %.1f frames/s drawn, %.1f loop ticks/s, %.1f allocations/frame\n",
+               g_frames.frames / seconds, g_frames.ticks / seconds,
+               (double)g_frames.allocations / g_frames.frames);
     }
+    g_frames.statsStart = now;
+    g_frames.ticks = 0;
+    g_frames.frames = 0;
+    g_frames.allocations = 0;
+}
+
+void main_loop() {
+    bool hadInput = false;
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+        ImGui_ImplSDL2_ProcessEvent(&event);
+        hadInput = true;
+        if (event.type == SDL_QUIT) {
+            g_app.running = false;
+        }
+    }
+    
+    double now = emscripten_get_now();
+    if (shouldRenderFrame(hadInput, now)) {
+        renderFrame();
+        g_frames.lastFrame = now;
+        g_frames.frames++;
+        
+        // Time-to-interactive: first frame is on screen
+        static bool firstFrame = true;
+        if (firstFrame) {
+            firstFrame = false;
+            EM_ASM({
+                if (typeof window.markInteractive === 'function') {
+                    window.markInteractive();
+                }
+            });
+        }
+    }
+    reportFrameStats(now);
+    checkMemory(now);
+    flushResponseCacheWhenIdle(now);
+    
+    // A batch run owns the context: chat replies and model swaps wait for it
+    bool justStarted = false;
+    if (g_app.batch->isRunning()) {
+        g_app.batch->step();
+    } else {
+        // Swap in a model finished by the background loader
+        handleModelLoad();
+        
+        // Speculatively prefill the message being typed while nothing is generating
+        g_app.ui->processDraftPrefill();
+        
+        // Fold turns that left the prompt window into the summary while idle
+        g_app.ui->processBackgroundSummary();
+        
+        // AFTER rendering, handle pending generation (just queues it)
+        if (g_app.ui->processPendingGeneration()) {
+            justStarted = true;
+        }
+        
+        // Process one token per frame if generating (but not on the frame we just started)
+        if (g_app.llm.isGenerating() && !justStarted) {
+            g_app.llm.stepGeneration();
+            g_app.ui->processGenerationError();
+        } else if (!justStarted && !g_app.llm.stepDraftPrefill() && g_app.ui->isIdle()) {
+            g_app.llm.stepBackgroundTask();
+        }
+    }
+    
+    updateLoopTiming(hadInput || g_frames.settleFrames > 0 || justStarted ||
+                     g_app.llm.isGenerating() || g_app.llm.isLoadingModel() ||
+                     g_app.llm.hasDraftWork() || g_app.llm.hasBackgroundTask() ||
+                     g_app.batch->isRunning());
 }
 
 int main(int argc, char** argv) {
@@ -121,6 +548,7 @@ int main(int argc, char** argv) {
     
     // Setup ImGui
     IMGUI_CHECKVERSION();
+    MemoryGovernor::installImGuiAllocator();
     ImGui::CreateContext();
     ImGuiIO& io = ImGui::GetIO();
     io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;
@@ -132,6 +560,7 @@ int main(int argc, char** argv) {
     // Initialize app
     g_app.running = true;
     g_app.ui = new UI(g_app.chatSession, g_app.llm);
+    g_app.batch = new BatchRunner(g_app.llm);
     g_app.ui->setup();
     
     // Add welcome message
@@ -139,7 +568,9 @@ int main(int argc, char** argv) {
         "Welcome to Terminal Chatbot powered by llama.cpp! "
         "Click 'LOAD MODEL' button to start chatting with Qwen2.5-0.5B!");
     
-    // Main loop - use 0 fps to sync with browser refresh rate (typically 60fps)
+    // Main loop - use 0 fps to sync with browser refresh rate (typically 60fps).
+    // The frame scheduler skips drawing and slows the loop down when idle.
+    g_frames.statsStart = emscripten_get_now();
     emscripten_set_main_loop(main_loop, 0, true);
     
     // Set swap interval AFTER main loop is established
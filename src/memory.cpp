@@ -0,0 +1,176 @@
+#include "memory.h"
+#include "imgui.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+#include <malloc.h>
+#include <emscripten/heap.h>
+
+// Headroom thresholds for the pressure levels
+static const size_t kElevatedHeadroom = 256u * 1024 * 1024;
+static const size_t kCriticalHeadroom = 96u * 1024 * 1024;
+
+// Widens a mallinfo field without sign-extending a wrapped int
+template <typename Field>
+static size_t mallinfoBytes(Field field) {
+    return (size_t)(typename std::make_unsigned<Field>::type)field;
+}
+
+static size_t g_imguiBytes = 0;
+static size_t g_allocations = 0;
+static size_t g_frameAllocations = 0;
+
+const char* getSubsystemLabel(MemorySubsystem subsystem) {
+    switch (subsystem) {
+        case MemorySubsystem::WEIGHTS: return "weights";
+        case MemorySubsystem::KV_CACHE: return "kv_cache";
+        case MemorySubsystem::COMPUTE: return "compute";
+        case MemorySubsystem::TOKENIZER: return "tokenizer";
+        case MemorySubsystem::ADAPTERS: return "adapters";
+        case MemorySubsystem::CHAT_HISTORY: return "chat_history";
+        case MemorySubsystem::RESPONSE_CACHE: return "response_cache";
+        case MemorySubsystem::UI: return "ui";
+        default: return "unknown";
+    }
+}
+
+const char* getPressureLabel(MemoryPressure pressure) {
+    switch (pressure) {
+        case MemoryPressure::NORMAL: return "normal";
+        case MemoryPressure::ELEVATED: return "elevated";
+        case MemoryPressure::CRITICAL: return "critical";
+        default: return "unknown";
+    }
+}
+
+MemoryGovernor::MemoryGovernor() : pressure(MemoryPressure::NORMAL), peakHeapSize(0) {
+    for (size_t& bytes : usage) {
+        bytes = 0;
+    }
+}
+
+HeapStats MemoryGovernor::sampleHeap() {
+    HeapStats stats;
+    struct mallinfo mi = mallinfo();
+    stats.heapMax = emscripten_get_heap_max();
+    stats.heapSize = emscripten_get_heap_size();
+    stats.exact = sizeof(mi.uordblks) >= sizeof(size_t) || stats.heapSize <= UINT32_MAX;
+    if (!stats.exact) {
+        stats.allocated = stats.heapSize;
+        stats.headroom = stats.heapMax - stats.heapSize;
+        return stats;
+    }
+    
+    size_t freeBytes = mallinfoBytes(mi.fordblks);
+    size_t keepcost = mallinfoBytes(mi.keepcost);
+    stats.allocated = std::min(mallinfoBytes(mi.uordblks), stats.heapSize);
+    stats.freeInHeap = std::min(freeBytes, stats.heapSize - stats.allocated);
+    stats.headroom = (stats.heapMax - stats.heapSize) + stats.freeInHeap;
+    if (stats.heapSize > 0 && freeBytes > keepcost) {
+        stats.fragmentation = (float)(freeBytes - keepcost) / stats.heapSize;
+    }
+    return stats;
+}
+
+void MemoryGovernor::setUsage(MemorySubsystem subsystem, size_t bytes) {
+    usage[(size_t)subsystem] = bytes;
+}
+
+size_t MemoryGovernor::getUsage(MemorySubsystem subsystem) const {
+    return usage[(size_t)subsystem];
+}
+
+MemoryPressure MemoryGovernor::update() {
+    heap = sampleHeap();
+    if (heap.heapSize > peakHeapSize) {
+        peakHeapSize = heap.heapSize;
+    }
+    
+    MemoryPressure level = MemoryPressure::NORMAL;
+    if (heap.headroom < kCriticalHeadroom) {
+        level = MemoryPressure::CRITICAL;
+    } else if (heap.headroom < kElevatedHeadroom) {
+        level = MemoryPressure::ELEVATED;
+    }
+    
+    if (level != pressure) {
+        printf("Memory pressure %s -> %s: %zu MB headroom, heap %zu/%zu MB, %.1f%% fragmented\n",
+               getPressureLabel(pressure), getPressureLabel(level), heap.headroom >> 20,
+               heap.heapSize >> 20, heap.heapMax >> 20, heap.fragmentation * 100.0f);
+        pressure = level;
+    }
+    return pressure;
+}
+
+MemoryPressure MemoryGovernor::getPressure() const {
+    return pressure;
+}
+
+const HeapStats& MemoryGovernor::getHeap() const {
+    return heap;
+}
+
+size_t MemoryGovernor::getPeakHeapSize() const {
+    return peakHeapSize;
+}
+
+std::string MemoryGovernor::toJson() const {
+    char buf[320];
+    snprintf(buf, sizeof(buf),
+             "{\"pressure\":\"%s\",\"heap\":{\"max\":%zu,\"size\":%zu,\"peak\":%zu,\"allocated\":%zu,"
+             "\"free\":%zu,\"headroom\":%zu,\"fragmentation\":%.3f,\"exact\":%s},\"subsystems\":{",
+             getPressureLabel(pressure), heap.heapMax, heap.heapSize, peakHeapSize, heap.allocated,
+             heap.freeInHeap, heap.headroom, heap.fragmentation, heap.exact ? "true" : "false");
+    std::string json = buf;
+    for (size_t i = 0; i < (size_t)MemorySubsystem::COUNT; i++) {
+        snprintf(buf, sizeof(buf), "%s\"%s\":%zu", i ? "," : "",
+                 getSubsystemLabel((MemorySubsystem)i), usage[i]);
+        json += buf;
+    }
+    snprintf(buf, sizeof(buf), "},\"frameAllocations\":%zu}", g_frameAllocations);
+    json += buf;
+    return json;
+}
+
+static void* imguiAlloc(size_t size, void*) {
+    void* ptr = malloc(size);
+    if (ptr) {
+        g_imguiBytes += malloc_usable_size(ptr);
+        g_allocations++;
+    }
+    return ptr;
+}
+
+static void imguiFree(void* ptr, void*) {
+    if (ptr) {
+        g_imguiBytes -= malloc_usable_size(ptr);
+    }
+    free(ptr);
+}
+
+void MemoryGovernor::installImGuiAllocator() {
+    ImGui::SetAllocatorFunctions(imguiAlloc, imguiFree);
+}
+
+size_t MemoryGovernor::getImGuiBytes() {
+    return g_imguiBytes;
+}
+
+void MemoryGovernor::countAllocation() {
+    g_allocations++;
+}
+
+void MemoryGovernor::beginFrame() {
+    g_allocations = 0;
+}
+
+size_t MemoryGovernor::endFrame() {
+    g_frameAllocations = g_allocations;
+    return g_frameAllocations;
+}
+
+size_t MemoryGovernor::getFrameAllocations() {
+    return g_frameAllocations;
+}
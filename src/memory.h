@@ -0,0 +1,80 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+// Subsystems whose live allocations are tracked
+enum class MemorySubsystem {
+    WEIGHTS,
+    KV_CACHE,
+    COMPUTE,
+    TOKENIZER,
+    ADAPTERS,
+    CHAT_HISTORY,
+    RESPONSE_CACHE,
+    UI,
+    COUNT
+};
+
+enum class MemoryPressure {
+    NORMAL,
+    ELEVATED, // Drop caches and old history
+    CRITICAL  // Also stop background work; loads are refused by the budget check
+};
+
+// Static label, safe to hold across frames
+const char* getSubsystemLabel(MemorySubsystem subsystem);
+const char* getPressureLabel(MemoryPressure pressure);
+
+// The wasm heap grows (never shrinks) up to heapMax. Headroom is what can
+// still be allocated: ungrown heap plus free space inside the grown part.
+struct HeapStats {
+    size_t heapMax = 0;
+    size_t heapSize = 0;
+    size_t allocated = 0;
+    size_t freeInHeap = 0;
+    size_t headroom = 0;
+    float fragmentation = 0.0f; // Free bytes stuck below the top chunk, over heapSize
+    bool exact = true;          // False past 4GB of heap: allocator figures unknown (see sampleHeap)
+};
+
+// Per-subsystem telemetry plus heap sampling. The owner feeds usage in,
+// calls update() periodically and reacts to the pressure level it returns.
+class MemoryGovernor {
+public:
+    MemoryGovernor();
+    
+    // mallinfo() has int fields in emscripten. They are read as 32-bit
+    // unsigned, exact below 4GB; past that (memory64 only) free space inside
+    // the heap is counted as zero and everything grown as allocated, which
+    // underestimates headroom rather than overestimating it.
+    static HeapStats sampleHeap();
+    
+    void setUsage(MemorySubsystem subsystem, size_t bytes);
+    size_t getUsage(MemorySubsystem subsystem) const;
+    
+    // Samples the heap and re-evaluates pressure; logs level changes
+    MemoryPressure update();
+    MemoryPressure getPressure() const;
+    const HeapStats& getHeap() const;
+    size_t getPeakHeapSize() const;
+    
+    std::string toJson() const;
+    
+    // Counts ImGui's allocations as UI; call before ImGui::CreateContext()
+    static void installImGuiAllocator();
+    static size_t getImGuiBytes();
+    
+    // Per-frame heap traffic of the UI: ImGui allocations plus the ones
+    // reported through countAllocation(). endFrame() returns the count since
+    // beginFrame(); getFrameAllocations() is the last finished frame's.
+    static void countAllocation();
+    static void beginFrame();
+    static size_t endFrame();
+    static size_t getFrameAllocations();
+
+private:
+    size_t usage[(size_t)MemorySubsystem::COUNT];
+    HeapStats heap;
+    MemoryPressure pressure;
+    size_t peakHeapSize;
+};
@@ -1,9 +1,11 @@
 #include "message.h"
+#include "memory.h"
+#include <cstring>
+#include <algorithm>
 
-Message::Message(MessageRole r, const std::string& c) 
-    : role(r), content(c), timestamp(std::time(nullptr)) {}
+static const size_t kChunkSize = 64 * 1024;
 
-std::string Message::getRoleString() const {
+const char* getRoleLabel(MessageRole role) {
     switch (role) {
         case MessageRole::USER: return "USER";
         case MessageRole::ASSISTANT: return "ASSISTANT";
@@ -12,3 +14,157 @@ std::string Message::getRoleString() const {
     }
 }
 
+const char* Message::getRoleString() const {
+    return getRoleLabel(role);
+}
+
+MessageStore::MessageStore() : usedBytes(0) {}
+
+size_t MessageStore::size() const {
+    return contents.size();
+}
+
+bool MessageStore::empty() const {
+    return contents.empty();
+}
+
+Message MessageStore::operator[](size_t index) const {
+    return Message{ roles[index], contents[index], timestamps[index] };
+}
+
+Message MessageStore::back() const {
+    return (*this)[contents.size() - 1];
+}
+
+// Bump-allocate from the current chunk, opening a new one when it is full
+char* MessageStore::allocate(size_t bytes) {
+    if (chunks.empty() || chunks.back().capacity - chunks.back().used < bytes) {
+        size_t capacity = std::max(kChunkSize, bytes * 2);
+        chunks.push_back(Chunk{ std::unique_ptr<char[]>(new char[capacity]), capacity, 0 });
+        MemoryGovernor::countAllocation();
+    }
+    
+    Chunk& chunk = chunks.back();
+    char* ptr = chunk.data.get() + chunk.used;
+    chunk.used += bytes;
+    usedBytes += bytes;
+    return ptr;
+}
+
+// True if the content ends exactly where the next allocation would start
+bool MessageStore::isArenaTail(std::string_view content) const {
+    if (chunks.empty()) return false;
+    const Chunk& chunk = chunks.back();
+    return content.data() + content.size() == chunk.data.get() + chunk.used;
+}
+
+void MessageStore::push(MessageRole role, std::string_view content) {
+    char* ptr = allocate(content.size());
+    if (!content.empty()) {
+        memcpy(ptr, content.data(), content.size());
+    }
+    
+    // The side tables grow together; count their reallocations as well
+    size_t capacity = contents.capacity();
+    contents.emplace_back(ptr, content.size());
+    roles.push_back(role);
+    timestamps.push_back(std::time(nullptr));
+    if (contents.capacity() != capacity) {
+        for (int i = 0; i < 3; i++) {
+            MemoryGovernor::countAllocation();
+        }
+    }
+}
+
+void MessageStore::append(size_t index, std::string_view text) {
+    if (index >= contents.size() || text.empty()) return;
+    
+    std::string_view& content = contents[index];
+    
+    // Streaming into the newest allocation: grow in place
+    if (isArenaTail(content) && chunks.back().capacity - chunks.back().used >= text.size()) {
+        char* end = allocate(text.size());
+        memcpy(end, text.data(), text.size());
+        content = std::string_view(content.data(), content.size() + text.size());
+        return;
+    }
+    
+    // Otherwise relocate; the old bytes stay in the arena until clear()
+    size_t newSize = content.size() + text.size();
+    char* ptr = allocate(newSize);
+    memcpy(ptr, content.data(), content.size());
+    memcpy(ptr + content.size(), text.data(), text.size());
+    content = std::string_view(ptr, newSize);
+}
+
+void MessageStore::popBack() {
+    if (contents.empty()) return;
+    
+    std::string_view content = contents.back();
+    if (isArenaTail(content)) {
+        chunks.back().used -= content.size();
+        usedBytes -= content.size();
+    }
+    
+    contents.pop_back();
+    roles.pop_back();
+    timestamps.pop_back();
+}
+
+void MessageStore::clear() {
+    if (chunks.size() > 1) {
+        chunks.resize(1);
+    }
+    if (!chunks.empty()) {
+        chunks[0].used = 0;
+    }
+    
+    contents.clear();
+    roles.clear();
+    timestamps.clear();
+    usedBytes = 0;
+}
+
+// Rebuilds the arena from the kept messages, so dropped text is actually freed
+void MessageStore::dropFront(size_t count) {
+    count = std::min(count, contents.size());
+    if (count == 0) return;
+    
+    MessageStore kept;
+    for (size_t i = count; i < contents.size(); i++) {
+        kept.push(roles[i], contents[i]);
+        kept.timestamps.back() = timestamps[i];
+    }
+    *this = std::move(kept);
+}
+
+// Rare (placeholders); rebuilds like dropFront() instead of leaving a hole
+void MessageStore::erase(size_t index) {
+    if (index >= contents.size()) return;
+    if (index == contents.size() - 1) {
+        popBack();
+        return;
+    }
+    
+    MessageStore kept;
+    for (size_t i = 0; i < contents.size(); i++) {
+        if (i == index) continue;
+        kept.push(roles[i], contents[i]);
+        kept.timestamps.back() = timestamps[i];
+    }
+    *this = std::move(kept);
+}
+
+size_t MessageStore::bytesUsed() const {
+    return usedBytes;
+}
+
+size_t MessageStore::bytesReserved() const {
+    size_t total = contents.capacity() * sizeof(std::string_view) +
+                   roles.capacity() * sizeof(MessageRole) +
+                   timestamps.capacity() * sizeof(time_t);
+    for (const auto& chunk : chunks) {
+        total += chunk.capacity;
+    }
+    return total;
+}
@@ -1,5 +1,8 @@
 #pragma once
 #include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
 #include <ctime>
 
 enum class MessageRole {
@@ -8,12 +11,53 @@ enum class MessageRole {
     SYSTEM
 };
 
+// Static label, safe to hold across frames
+const char* getRoleLabel(MessageRole role);
+
+// View of a stored message; content points into the MessageStore arena
 struct Message {
     MessageRole role;
-    std::string content;
+    std::string_view content;
     time_t timestamp;
     
-    Message(MessageRole r, const std::string& c);
-    std::string getRoleString() const;
+    const char* getRoleString() const;
 };
 
+// Chat history backed by a chunked monotonic arena. Message text lives in
+// large chunks, roles and timestamps in parallel arrays. Finished messages
+// never move; only the last message may be relocated while it grows.
+class MessageStore {
+public:
+    MessageStore();
+    
+    size_t size() const;
+    bool empty() const;
+    Message operator[](size_t index) const;
+    Message back() const;
+    
+    void push(MessageRole role, std::string_view content);
+    void append(size_t index, std::string_view text);
+    void popBack();
+    void clear(); // Keeps the first chunk for reuse
+    void dropFront(size_t count); // Oldest first; indices of the rest shift down
+    void erase(size_t index);     // Later indices shift down
+    
+    size_t bytesUsed() const;
+    size_t bytesReserved() const;
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        size_t used;
+    };
+    
+    char* allocate(size_t bytes);
+    bool isArenaTail(std::string_view content) const;
+    
+    std::vector<Chunk> chunks;
+    std::vector<std::string_view> contents;
+    std::vector<MessageRole> roles;
+    std::vector<time_t> timestamps;
+    size_t usedBytes;
+};
@@ -0,0 +1,190 @@
+#include "response_cache.h"
+#include "storage.h"
+#include <cstdio>
+#include <cstdlib>
+
+// localStorage quota is ~5MB of UTF-16, keep the hex dump well below it
+static const size_t kMaxPersistBytes = 1024 * 1024;
+
+// The whole cache is re-serialized on save, so inserts are batched
+static const size_t kSaveEveryInserts = 8;
+
+std::string_view CachedResponse::piece(size_t i) const {
+    size_t begin = (i == 0) ? 0 : pieceEnds[i - 1];
+    return std::string_view(text).substr(begin, pieceEnds[i] - begin);
+}
+
+size_t CachedResponse::byteSize() const {
+    return sizeof(CachedResponse) + text.size() + pieceEnds.size() * sizeof(uint32_t);
+}
+
+ResponseCache::ResponseCache(size_t maxBytes) : maxBytes(maxBytes), totalBytes(0), unsavedInserts(0) {}
+
+uint64_t ResponseCache::hashBytes(const void* data, size_t len, uint64_t seed) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+const CachedResponse* ResponseCache::lookup(uint64_t key) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+        stats.misses++;
+        return nullptr;
+    }
+    
+    stats.hits++;
+    entries.splice(entries.begin(), entries, it->second);
+    return &it->second->second;
+}
+
+void ResponseCache::insert(uint64_t key, CachedResponse response) {
+    size_t size = response.byteSize();
+    if (size > maxBytes) return;
+    
+    auto it = index.find(key);
+    if (it != index.end()) {
+        totalBytes -= it->second->second.byteSize();
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    
+    entries.emplace_front(key, std::move(response));
+    index[key] = entries.begin();
+    totalBytes += size;
+    evictToFit();
+    
+    if (!persistKey.empty() && ++unsavedInserts >= kSaveEveryInserts) {
+        save();
+    }
+}
+
+void ResponseCache::evictToFit() {
+    while (totalBytes > maxBytes && !entries.empty()) {
+        totalBytes -= entries.back().second.byteSize();
+        index.erase(entries.back().first);
+        entries.pop_back();
+        stats.evictions++;
+    }
+}
+
+void ResponseCache::clear() {
+    entries.clear();
+    index.clear();
+    totalBytes = 0;
+}
+
+void ResponseCache::setPersistent(const std::string& storageKey) {
+    persistKey = storageKey;
+    if (!persistKey.empty()) {
+        load();
+    }
+}
+
+// Format: one line per entry, "key piece_end,piece_end,... hex(text)"
+void ResponseCache::save() {
+    if (persistKey.empty()) return;
+    unsavedInserts = 0;
+    
+    static const char* hex = "0123456789abcdef";
+    std::string out;
+    size_t written = 0;
+    
+    for (const auto& entry : entries) {
+        const CachedResponse& r = entry.second;
+        if (written + r.byteSize() > kMaxPersistBytes) break;
+        written += r.byteSize();
+        
+        char key[24];
+        snprintf(key, sizeof(key), "%016llx ", (unsigned long long)entry.first);
+        out += key;
+        for (size_t i = 0; i < r.pieceEnds.size(); i++) {
+            if (i > 0) out += ',';
+            out += std::to_string(r.pieceEnds[i]);
+        }
+        out += ' ';
+        for (unsigned char c : r.text) {
+            out += hex[c >> 4];
+            out += hex[c & 0x0F];
+        }
+        out += '\n';
+    }
+    
+    Storage::save(persistKey, out);
+}
+
+void ResponseCache::flush() {
+    if (unsavedInserts > 0) {
+        save();
+    }
+}
+
+// Replay slices text by pieceEnds, so they must be ascending and in range
+static bool isValidEntry(const CachedResponse& r) {
+    uint32_t previous = 0;
+    for (uint32_t end : r.pieceEnds) {
+        if (end < previous || end > r.text.size()) return false;
+        previous = end;
+    }
+    return !r.pieceEnds.empty() && r.pieceEnds.back() == r.text.size();
+}
+
+void ResponseCache::load() {
+    std::string data = Storage::load(persistKey);
+    size_t pos = 0;
+    
+    // Saved most recent first, insert in reverse to keep LRU order
+    std::vector<std::pair<uint64_t, CachedResponse>> loadedEntries;
+    while (pos < data.size()) {
+        size_t eol = data.find('\n', pos);
+        if (eol == std::string::npos) eol = data.size();
+        std::string line = data.substr(pos, eol - pos);
+        pos = eol + 1;
+        
+        size_t s1 = line.find(' ');
+        size_t s2 = line.find(' ', s1 + 1);
+        if (s1 == std::string::npos || s2 == std::string::npos) continue;
+        
+        CachedResponse r;
+        uint64_t key = strtoull(line.substr(0, s1).c_str(), nullptr, 16);
+        
+        const char* ends = line.c_str() + s1 + 1;
+        while (ends < line.c_str() + s2) {
+            char* next = nullptr;
+            r.pieceEnds.push_back((uint32_t)strtoul(ends, &next, 10));
+            if (next == ends) break;
+            ends = (*next == ',') ? next + 1 : next;
+        }
+        
+        for (size_t i = s2 + 1; i + 1 < line.size(); i += 2) {
+            r.text += (char)strtol(line.substr(i, 2).c_str(), nullptr, 16);
+        }
+        
+        if (isValidEntry(r)) {
+            loadedEntries.emplace_back(key, std::move(r));
+        } else {
+            printf("Response cache: dropping corrupt entry %016llx\n", (unsigned long long)key);
+        }
+    }
+    
+    std::string savedKey = persistKey;
+    persistKey.clear(); // Don't write back while restoring
+    for (auto it = loadedEntries.rbegin(); it != loadedEntries.rend(); ++it) {
+        insert(it->first, std::move(it->second));
+    }
+    persistKey = savedKey;
+    unsavedInserts = 0;
+    
+    printf("Response cache restored: %zu entries\n", entries.size());
+}
+
+ResponseCacheStats ResponseCache::getStats() const {
+    ResponseCacheStats s = stats;
+    s.entries = entries.size();
+    s.bytes = totalBytes;
+    return s;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+// A recorded reply: the pieces streamed to the UI, stored back to back
+struct CachedResponse {
+    std::string text;
+    std::vector<uint32_t> pieceEnds; // End offset of each piece in text
+    
+    size_t pieceCount() const { return pieceEnds.size(); }
+    std::string_view piece(size_t i) const;
+    size_t byteSize() const;
+};
+
+struct ResponseCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// LRU cache of replies keyed by (model, sampler config, prompt tokens),
+// bounded by total byte size. Only deterministic generations are stored.
+class ResponseCache {
+public:
+    explicit ResponseCache(size_t maxBytes = 8 * 1024 * 1024);
+    
+    // FNV-1a, chainable by passing the previous hash as seed
+    static uint64_t hashBytes(const void* data, size_t len, uint64_t seed = 14695981039346656037ULL);
+    
+    // Returns nullptr on miss; a hit becomes the most recently used entry
+    const CachedResponse* lookup(uint64_t key);
+    void insert(uint64_t key, CachedResponse response);
+    void clear();
+    
+    // Optional persistence to localStorage (most recent entries only).
+    // Inserts are written every few replies; flush() writes the rest and is
+    // meant for idle time and page hide.
+    void setPersistent(const std::string& storageKey);
+    void save();
+    void flush();
+    void load();
+    
+    ResponseCacheStats getStats() const;
+
+private:
+    typedef std::list<std::pair<uint64_t, CachedResponse>> EntryList;
+    
+    void evictToFit();
+    
+    EntryList entries; // Front = most recently used
+    std::unordered_map<uint64_t, EntryList::iterator> index;
+    size_t maxBytes;
+    size_t totalBytes;
+    std::string persistKey;
+    size_t unsavedInserts;
+    ResponseCacheStats stats;
+};
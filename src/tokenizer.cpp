@@ -0,0 +1,124 @@
+#include "tokenizer.h"
+#include "llama.h"
+#include <cstdio>
+
+Tokenizer::Tokenizer() : vocab(nullptr) {}
+
+void Tokenizer::build(const llama_vocab* v) {
+    vocab = v;
+    
+    int n_vocab = llama_vocab_n_tokens(vocab);
+    pieceData.clear();
+    pieceData.reserve((size_t)n_vocab * 8);
+    pieceOffsets.resize(n_vocab + 1);
+    
+    std::vector<char> buf(256);
+    for (int id = 0; id < n_vocab; id++) {
+        pieceOffsets[id] = (uint32_t)pieceData.size();
+        
+        int n = llama_token_to_piece(vocab, id, buf.data(), (int)buf.size(), 0, false);
+        if (n < 0) {
+            // Longer than the scratch buffer: grow it instead of truncating
+            buf.resize(-n);
+            n = llama_token_to_piece(vocab, id, buf.data(), (int)buf.size(), 0, false);
+        }
+        if (n > 0) {
+            pieceData.insert(pieceData.end(), buf.data(), buf.data() + n);
+        }
+    }
+    pieceOffsets[n_vocab] = (uint32_t)pieceData.size();
+    pieceData.shrink_to_fit();
+    
+    printf("Tokenizer piece table: %d tokens, %zu KB\n", n_vocab, tableBytes() / 1024);
+}
+
+void Tokenizer::clear() {
+    vocab = nullptr;
+    pieceData.clear();
+    pieceOffsets.clear();
+}
+
+bool Tokenizer::isBuilt() const {
+    return vocab != nullptr;
+}
+
+const std::vector<int>& Tokenizer::tokenize(std::string_view text, bool addSpecial) const {
+    thread_local std::vector<int> tokens;
+    
+    if (!vocab) {
+        tokens.clear();
+        return tokens;
+    }
+    
+    // A token covers at least one byte, plus BOS/EOS when specials are added
+    size_t estimate = text.size() + (addSpecial ? 2 : 0);
+    if (tokens.size() < estimate) {
+        tokens.resize(estimate);
+    }
+    
+    int n = llama_tokenize(vocab, text.data(), (int)text.size(),
+                           tokens.data(), (int)tokens.size(), addSpecial, false);
+    if (n < 0) {
+        tokens.resize(-n);
+        n = llama_tokenize(vocab, text.data(), (int)text.size(),
+                           tokens.data(), (int)tokens.size(), addSpecial, false);
+    }
+    
+    // Shrinking keeps the capacity for the next call
+    tokens.resize(n > 0 ? n : 0);
+    return tokens;
+}
+
+std::string_view Tokenizer::piece(int token) const {
+    if (token < 0 || (size_t)token + 1 >= pieceOffsets.size()) {
+        return std::string_view();
+    }
+    uint32_t begin = pieceOffsets[token];
+    return std::string_view(pieceData.data() + begin, pieceOffsets[token + 1] - begin);
+}
+
+size_t Tokenizer::tableBytes() const {
+    return pieceData.capacity() + pieceOffsets.capacity() * sizeof(uint32_t);
+}
+
+size_t completeUtf8Prefix(std::string_view s) {
+    size_t len = s.size();
+    
+    // Walk back over at most 3 continuation bytes to the last lead byte
+    size_t i = len;
+    int continuation = 0;
+    while (i > 0 && continuation < 4) {
+        unsigned char c = (unsigned char)s[i - 1];
+        if ((c & 0xC0) != 0x80) break;
+        i--;
+        continuation++;
+    }
+    if (i == 0) return len; // Only continuation bytes: nothing to wait for
+    
+    unsigned char lead = (unsigned char)s[i - 1];
+    size_t expected = 1;
+    if ((lead & 0xE0) == 0xC0) expected = 2;
+    else if ((lead & 0xF0) == 0xE0) expected = 3;
+    else if ((lead & 0xF8) == 0xF0) expected = 4;
+    
+    size_t have = len - (i - 1);
+    return have < expected ? i - 1 : len;
+}
+
+std::string_view Utf8Stream::push(std::string_view piece) {
+    // Fast path: nothing held back and the piece ends on a boundary
+    if (pending.empty() && completeUtf8Prefix(piece) == piece.size()) {
+        return piece;
+    }
+    
+    pending.append(piece.data(), piece.size());
+    size_t complete = completeUtf8Prefix(pending);
+    out.assign(pending, 0, complete);
+    pending.erase(0, complete);
+    return out;
+}
+
+void Utf8Stream::reset() {
+    pending.clear();
+    out.clear();
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+struct llama_vocab;
+
+// Tokenizer front-end built once per model: tokenizes into reusable
+// thread-local buffers and turns token IDs into text with a table lookup.
+class Tokenizer {
+public:
+    Tokenizer();
+    
+    // Precompute every token's piece (flat char array + offsets)
+    void build(const llama_vocab* vocab);
+    void clear();
+    bool isBuilt() const;
+    
+    // Result lives in a thread-local buffer, valid until the next call on this thread
+    const std::vector<int>& tokenize(std::string_view text, bool addSpecial) const;
+    
+    // Empty for control tokens and unknown IDs
+    std::string_view piece(int token) const;
+    
+    size_t tableBytes() const;
+
+private:
+    const llama_vocab* vocab;
+    std::vector<char> pieceData;
+    std::vector<uint32_t> pieceOffsets; // n_vocab + 1 entries
+};
+
+// Length of the longest prefix of s that ends on a character boundary
+size_t completeUtf8Prefix(std::string_view s);
+
+// Holds back bytes of a UTF-8 character split across token pieces so the
+// UI only ever receives complete characters.
+class Utf8Stream {
+public:
+    // Returns the complete text available so far; view valid until the next call
+    std::string_view push(std::string_view piece);
+    void reset();
+
+private:
+    std::string pending;
+    std::string out;
+};
@@ -3,6 +3,7 @@
 #include "llm.h"
 #include <imgui.h>
 #include <string>
+#include <vector>
 
 class UI {
 public:
@@ -11,6 +12,15 @@ public:
     void setup();
     void render();
     bool processPendingGeneration(); // Returns true if generation was just started
+    void processGenerationError();   // Shows a failed reply's error in its bubble
+    void processDraftPrefill();      // Hands the debounced input draft to the LLM
+    void processBackgroundSummary(); // Schedules summaries of turns leaving the prompt window
+    bool isIdle() const;             // No typing or generation for a while: background work may run
+    void setBackgroundPaused(bool paused); // No new summary jobs (critical memory pressure)
+    
+    // Frame scheduling hints
+    bool needsRedraw() const;  // Chat or model state changed since the last frame
+    bool isAnimating() const;  // Loading dots or load progress on screen
     
 private:
     // Core rendering
@@ -23,6 +33,11 @@ private:
     void renderMessageList();
     void renderInputArea();
     void renderLoadingIndicator();
+    void renderReplyActions();
+    
+    // Regenerate the last reply as several alternatives and page through them
+    void retryLastReply();
+    void showAlternative(size_t index);
     
     // Model management
     void renderModelDialog();
@@ -36,11 +51,32 @@ private:
     bool autoScroll;
     float chatScrollY;
     
+    // Speculative prefill of the message being typed
+    bool draftDirty;
+    double draftEditTime;
+    
+    // Message count at which a summary job did not fit; retried once it changes
+    size_t summaryBlockedAt;
+    bool backgroundPaused;
+    
+    // Alternatives for the reply at alternativesMessage (always the last message)
+    std::vector<std::string> alternatives;
+    size_t alternativesMessage;
+    size_t shownAlternative;
+    bool pendingAlternatives;
+    
     // Deferred generation (to allow UI to render user message first)
     bool pendingGeneration;
     std::string pendingPrompt;
     size_t pendingResponseIndex;
     
+    // State drawn by the last frame, compared by needsRedraw()
+    size_t drawnMessageCount;
+    size_t drawnMessageBytes;
+    int drawnModelState;
+    
+    int modelStateBits() const;
+    
     // Colors
     ImVec4 colorBackground;
     ImVec4 colorTerminal;
@@ -1,5 +1,9 @@
 #include "ui.h"
 #include <cstring>
+#include <emscripten.h>
+
+// Replies generated side by side by RETRY
+static const size_t kAlternatives = 3;
 
 void UI::renderChatView() {
     // Calculate available height
@@ -29,12 +33,12 @@ void UI::renderMessageList() {
     }
     
     for (size_t i = 0; i < messages.size(); i++) {
-        const auto& msg = messages[i];
+        Message msg = messages[i];
         ImVec4 color = (msg.role == MessageRole::USER) ? colorUser : colorAssistant;
         
         // Role header
         ImGui::PushStyleColor(ImGuiCol_Text, color);
-        ImGui::Text("[%s]", msg.getRoleString().c_str());
+        ImGui::Text("[%s]", msg.getRoleString());
         ImGui::PopStyleColor();
         
         // Message content
@@ -44,15 +48,71 @@ void UI::renderMessageList() {
         if (i == messages.size() - 1 && msg.content.empty() && llm.isGenerating()) {
             renderLoadingIndicator();
         } else {
-            ImGui::TextWrapped("%s", msg.content.c_str());
+            // Wrapped view straight into the history arena, no copy or format pass
+            ImGui::PushTextWrapPos(0.0f);
+            ImGui::TextUnformatted(msg.content.data(), msg.content.data() + msg.content.size());
+            ImGui::PopTextWrapPos();
         }
         
         ImGui::PopStyleColor();
         
+        if (i == messages.size() - 1 && msg.role == MessageRole::ASSISTANT) {
+            renderReplyActions();
+        }
+        
         ImGui::Spacing();
     }
 }
 
+// RETRY and the alternatives pager under the last reply
+void UI::renderReplyActions() {
+    size_t last = chatSession.getMessages().size() - 1;
+    
+    if (alternatives.size() > 1 && alternativesMessage == last) {
+        if (ImGui::SmallButton("<") && shownAlternative > 0) {
+            showAlternative(shownAlternative - 1);
+        }
+        ImGui::SameLine();
+        ImGui::Text("%zu/%zu", shownAlternative + 1, alternatives.size());
+        ImGui::SameLine();
+        if (ImGui::SmallButton(">") && shownAlternative + 1 < alternatives.size()) {
+            showAlternative(shownAlternative + 1);
+        }
+        ImGui::SameLine();
+    }
+    
+    if (llm.isLoaded() && !llm.isGenerating() && !pendingGeneration && ImGui::SmallButton("RETRY")) {
+        retryLastReply();
+    }
+}
+
+void UI::retryLastReply() {
+    const MessageStore& messages = chatSession.getMessages();
+    if (messages.size() < 2 || messages[messages.size() - 2].role != MessageRole::USER) {
+        return;
+    }
+    
+    // Same prompt as the original reply; the KV cache still holds it
+    chatSession.removeLastMessage();
+    pendingPrompt = chatSession.buildPrompt();
+    chatSession.addMessage(MessageRole::ASSISTANT, "");
+    pendingResponseIndex = chatSession.getMessages().size() - 1;
+    
+    alternatives.assign(kAlternatives, std::string());
+    alternativesMessage = pendingResponseIndex;
+    shownAlternative = 0;
+    pendingAlternatives = true;
+    pendingGeneration = true;
+    autoScroll = true;
+}
+
+void UI::showAlternative(size_t index) {
+    if (alternativesMessage != chatSession.getMessages().size() - 1) return;
+    
+    shownAlternative = index;
+    chatSession.replaceLastMessage(alternatives[index]);
+}
+
 void UI::renderLoadingIndicator() {
     // Animated "thinking" dots
     float time = ImGui::GetTime();
@@ -80,6 +140,10 @@ void UI::renderInputArea() {
                                                    ImVec2(0, 60),
                                                    ImGuiInputTextFlags_EnterReturnsTrue | 
                                                    ImGuiInputTextFlags_CtrlEnterForNewLine);
+    if (ImGui::IsItemEdited()) {
+        draftDirty = true;
+        draftEditTime = emscripten_get_now();
+    }
     ImGui::PopItemWidth();
     
     ImGui::SameLine();
@@ -101,17 +165,21 @@ void UI::renderInputArea() {
             return;
         }
         
-        // Stop any ongoing generation if user sends new message
+        // Stop any ongoing generation if user sends new message; the partial
+        // reply stays in the history and in the KV cache, so only the new
+        // user turn needs to be prefilled
         if (llm.isGenerating()) {
-            llm.stopGeneration();
+            llm.stopGeneration(StopMode::KEEP_PARTIAL);
         }
         
         // Add user message immediately - it will show up right away!
         chatSession.addMessage(MessageRole::USER, userMessage);
+        alternatives.clear();
         autoScroll = true;  // Force scroll to show the new message
         
         // Clear input immediately
         memset(inputBuffer, 0, sizeof(inputBuffer));
+        draftDirty = false;
         
         // Build prompt
         pendingPrompt = chatSession.buildPrompt();
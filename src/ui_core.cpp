@@ -1,10 +1,15 @@
 #include "ui.h"
+#include "memory.h"
 #include <cstring>
+#include <cstdio>
 #include <emscripten.h>
 
 UI::UI(ChatSession& chat, LLM& llm) 
     : chatSession(chat), llm(llm), showModelDialog(false), autoScroll(true), chatScrollY(0.0f),
-      pendingGeneration(false), pendingResponseIndex(0) {
+      draftDirty(false), draftEditTime(0.0), summaryBlockedAt(0), backgroundPaused(false),
+      alternativesMessage(0), shownAlternative(0), pendingAlternatives(false),
+      pendingGeneration(false), pendingResponseIndex(0),
+      drawnMessageCount(0), drawnMessageBytes(0), drawnModelState(0) {
     memset(inputBuffer, 0, sizeof(inputBuffer));
     
     // Terminal green color scheme
@@ -51,6 +56,10 @@ void UI::applyTerminalStyle() {
 void UI::render() {
     ImGuiIO& io = ImGui::GetIO();
     
+    drawnMessageCount = chatSession.getMessages().size();
+    drawnMessageBytes = chatSession.getMessages().bytesUsed();
+    drawnModelState = modelStateBits();
+    
     // Full screen window
     ImGui::SetNextWindowPos(ImVec2(0, 0));
     ImGui::SetNextWindowSize(io.DisplaySize);
@@ -84,13 +93,25 @@ bool UI::processPendingGeneration() {
     if (pendingGeneration) {
         pendingGeneration = false;
         
+        if (pendingAlternatives) {
+            pendingAlternatives = false;
+            llm.startAlternatives(pendingPrompt, (int)alternatives.size(), [this](int index, std::string_view token) {
+                if ((size_t)index >= alternatives.size()) return;
+                alternatives[index].append(token.data(), token.size());
+                if ((size_t)index == shownAlternative && pendingResponseIndex < chatSession.getMessages().size()) {
+                    chatSession.appendToMessage(pendingResponseIndex, token);
+                    autoScroll = true;
+                }
+            });
+            return true;
+        }
+        
         // Start generation with the stored prompt and callback
         // This just queues it, actual processing happens on next frame
-        llm.startGeneration(pendingPrompt, [this](const std::string& token) {
+        llm.startGeneration(pendingPrompt, [this](std::string_view token) {
             // Update the last message with streaming tokens in real-time
-            auto& messages = const_cast<std::vector<Message>&>(chatSession.getMessages());
-            if (pendingResponseIndex < messages.size()) {
-                messages[pendingResponseIndex].content += token;
+            if (pendingResponseIndex < chatSession.getMessages().size()) {
+                chatSession.appendToMessage(pendingResponseIndex, token);
                 autoScroll = true;  // Keep scrolling as tokens arrive
             }
         });
@@ -101,11 +122,113 @@ bool UI::processPendingGeneration() {
     return false; // No generation started
 }
 
+void UI::processGenerationError() {
+    std::string error;
+    if (!llm.takeGenerationError(error) || pendingResponseIndex >= chatSession.getMessages().size()) {
+        return;
+    }
+    
+    bool empty = chatSession.getMessages()[pendingResponseIndex].content.empty();
+    chatSession.appendToMessage(pendingResponseIndex, (empty ? "[Error] " : "\n\n[Error] ") + error);
+    autoScroll = true;
+}
+
+// Wait for a pause in typing before prefilling the draft
+static const double kDraftDebounceMs = 300.0;
+
+void UI::processDraftPrefill() {
+    if (!draftDirty || emscripten_get_now() - draftEditTime < kDraftDebounceMs) {
+        return;
+    }
+    
+    // Typed while a reply streams: keep it pending until the context is free
+    if (llm.isGenerating() || pendingGeneration) {
+        return;
+    }
+    draftDirty = false;
+    
+    if (!llm.isLoaded() || inputBuffer[0] == '\0') {
+        return;
+    }
+    llm.prefillDraft(chatSession.buildDraftPrompt(inputBuffer));
+}
+
+// Background summaries wait until the user has stopped typing for this long
+static const double kSummaryIdleMs = 2000.0;
+
+// Summary length limit, in tokens
+static const int kSummaryMaxTokens = 128;
+
+bool UI::isIdle() const {
+    return !pendingGeneration && !draftDirty && !llm.isGenerating() && !llm.hasDraftWork() &&
+           emscripten_get_now() - draftEditTime >= kSummaryIdleMs;
+}
+
+void UI::setBackgroundPaused(bool paused) {
+    backgroundPaused = paused;
+}
+
+void UI::processBackgroundSummary() {
+    const MessageStore& messages = chatSession.getMessages();
+    if (backgroundPaused || !llm.isLoaded() || llm.hasBackgroundTask() || !chatSession.hasPendingSummary() ||
+        messages.size() == summaryBlockedAt || !isIdle()) {
+        return;
+    }
+    
+    size_t from = chatSession.getSummarizedCount();
+    size_t upTo = 0;
+    std::string prompt = chatSession.buildSummaryPrompt(upTo);
+    bool started = llm.startBackgroundTask(prompt, kSummaryMaxTokens, [this, from, upTo](std::string text) {
+        // The summary lives in the system turn, so the prefilled draft is stale
+        if (chatSession.applySummary(from, upTo, text)) {
+            draftDirty = true;
+        }
+    });
+    if (!started) {
+        summaryBlockedAt = messages.size();
+    }
+}
+
+int UI::modelStateBits() const {
+    return (llm.isLoaded() ? 1 : 0) | (llm.isGenerating() ? 2 : 0) | (llm.isLoadingModel() ? 4 : 0);
+}
+
+bool UI::needsRedraw() const {
+    const MessageStore& messages = chatSession.getMessages();
+    return pendingGeneration ||
+           messages.size() != drawnMessageCount ||
+           messages.bytesUsed() != drawnMessageBytes ||
+           modelStateBits() != drawnModelState;
+}
+
+bool UI::isAnimating() const {
+    if (llm.isLoadingModel()) return true;
+    
+    // Thinking dots until the first token of the reply arrives
+    const MessageStore& messages = chatSession.getMessages();
+    return llm.isGenerating() && !messages.empty() && messages.back().content.empty();
+}
+
 void UI::renderHeader() {
     ImGui::Text("TERMINAL CHATBOT - WEBGPU + LLAMA.CPP");
-    ImGui::SameLine(ImGui::GetWindowWidth() - 200);
     
-    if (ImGui::Button("LOAD MODEL")) {
+    if (llm.isLoadingModel()) {
+        // Progress of the background load, the current model stays usable
+        float progress = llm.getLoadProgress();
+        char overlay[32];
+        snprintf(overlay, sizeof(overlay), "LOADING %d%%", (int)(progress * 100.0f));
+        
+        ImGui::SameLine(ImGui::GetWindowWidth() - 380);
+        ImGui::ProgressBar(progress, ImVec2(180, 0), overlay);
+        ImGui::SameLine();
+        if (ImGui::Button("CANCEL")) {
+            llm.cancelModelLoad();
+        }
+    } else {
+        ImGui::SameLine(ImGui::GetWindowWidth() - 200);
+    }
+    
+    if (!llm.isLoadingModel() && ImGui::Button("LOAD MODEL")) {
         EM_ASM({
             if (typeof window.loadLocalModel === 'function') {
                 window.loadLocalModel();
@@ -117,6 +240,12 @@ void UI::renderHeader() {
     
     ImGui::SameLine();
     if (ImGui::Button("CLEAR CHAT")) {
+        // Stop the reply first: its callbacks index the state cleared below
+        llm.stopGeneration(StopMode::ROLLBACK);
+        llm.cancelBackgroundTask();
+        pendingGeneration = false;
+        pendingAlternatives = false;
+        alternatives.clear();
         chatSession.clearMessages();
     }
 }
@@ -133,7 +262,11 @@ void UI::renderFooter() {
         }
     }
     
-    ImGui::SameLine(ImGui::GetWindowWidth() - 300);
-    ImGui::Text("Messages: %zu", chatSession.getMessages().size());
+    ImGui::SameLine(ImGui::GetWindowWidth() - 400);
+    ResponseCacheStats cache = llm.getResponseCache().getStats();
+    const MessageStore& messages = chatSession.getMessages();
+    ImGui::Text("Messages: %zu (%zuKB, %zu allocs/frame)  Cache: %llu/%llu", messages.size(),
+                messages.bytesReserved() / 1024, MemoryGovernor::getFrameAllocations(),
+                (unsigned long long)cache.hits, (unsigned long long)(cache.hits + cache.misses));
 }
 
@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""Writes a loadable llama-architecture GGUF of roughly the requested size.
+
+The weights are all zero and the file is sparse, so a multi-GB model costs
+almost no disk space or time to generate. The vocabulary is the 256 byte
+tokens plus <unk>/<s>/</s>, enough for llama.cpp and the app's tokenizer.
+
+    python3 tests/make_synthetic_gguf.py docs/test/synthetic.gguf --size-gb 4.5
+"""
+import argparse
+import os
+import struct
+
+ALIGNMENT = 32
+
+# GGUF value types
+UINT32, INT32, FLOAT32, STRING, ARRAY = 4, 5, 6, 8, 9
+
+# ggml tensor types
+F32, F16 = 0, 1
+
+EMBED = 4096
+HEADS = 32
+FFN = 11008
+CONTEXT = 2048
+
+
+def pack_string(s):
+    data = s.encode('utf-8')
+    return struct.pack('<Q', len(data)) + data
+
+
+def pack_value(vtype, value):
+    if vtype == UINT32:
+        return struct.pack('<I', value)
+    if vtype == INT32:
+        return struct.pack('<i', value)
+    if vtype == FLOAT32:
+        return struct.pack('<f', value)
+    if vtype == STRING:
+        return pack_string(value)
+    raise ValueError(vtype)
+
+
+def pack_kv(key, vtype, value):
+    out = pack_string(key) + struct.pack('<I', vtype)
+    if vtype == ARRAY:
+        item_type, items = value
+        out += struct.pack('<IQ', item_type, len(items))
+        out += b''.join(pack_value(item_type, item) for item in items)
+    else:
+        out += pack_value(vtype, value)
+    return out
+
+
+def vocab():
+    tokens = ['<unk>', '<s>', '</s>'] + ['<0x%02X>' % b for b in range(256)]
+    scores = [0.0] * len(tokens)
+    types = [2, 3, 3] + [6] * 256  # unknown, control, control, byte
+    return tokens, scores, types
+
+
+def layer_tensors(i):
+    prefix = 'blk.%d.' % i
+    return [
+        (prefix + 'attn_norm.weight', [EMBED], F32),
+        (prefix + 'attn_q.weight', [EMBED, EMBED], F16),
+        (prefix + 'attn_k.weight', [EMBED, EMBED], F16),
+        (prefix + 'attn_v.weight', [EMBED, EMBED], F16),
+        (prefix + 'attn_output.weight', [EMBED, EMBED], F16),
+        (prefix + 'ffn_norm.weight', [EMBED], F32),
+        (prefix + 'ffn_gate.weight', [EMBED, FFN], F16),
+        (prefix + 'ffn_up.weight', [EMBED, FFN], F16),
+        (prefix + 'ffn_down.weight', [FFN, EMBED], F16),
+    ]
+
+
+def tensor_bytes(dims, ttype):
+    count = 1
+    for d in dims:
+        count *= d
+    return count * (4 if ttype == F32 else 2)
+
+
+def align(n):
+    return (n + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('output')
+    parser.add_argument('--size-gb', type=float, default=4.5, help='approximate file size in GiB')
+    args = parser.parse_args()
+
+    tokens, scores, types = vocab()
+    per_layer = sum(tensor_bytes(d, t) for _, d, t in layer_tensors(0))
+    layers = max(1, int(round(args.size_gb * (1 << 30) / per_layer)))
+
+    tensors = [('token_embd.weight', [EMBED, len(tokens)], F16)]
+    for i in range(layers):
+        tensors += layer_tensors(i)
+    tensors += [('output_norm.weight', [EMBED], F32),
+                ('output.weight', [EMBED, len(tokens)], F16)]
+
+    kvs = [
+        pack_kv('general.architecture', STRING, 'llama'),
+        pack_kv('general.name', STRING, 'synthetic-memory64-test'),
+        pack_kv('general.alignment', UINT32, ALIGNMENT),
+        pack_kv('llama.context_length', UINT32, CONTEXT),
+        pack_kv('llama.embedding_length', UINT32, EMBED),
+        pack_kv('llama.block_count', UINT32, layers),
+        pack_kv('llama.feed_forward_length', UINT32, FFN),
+        pack_kv('llama.rope.dimension_count', UINT32, EMBED // HEADS),
+        pack_kv('llama.attention.head_count', UINT32, HEADS),
+        pack_kv('llama.attention.head_count_kv', UINT32, HEADS),
+        pack_kv('llama.attention.layer_norm_rms_epsilon', FLOAT32, 1e-5),
+        pack_kv('tokenizer.ggml.model', STRING, 'llama'),
+        pack_kv('tokenizer.ggml.tokens', ARRAY, (STRING, tokens)),
+        pack_kv('tokenizer.ggml.scores', ARRAY, (FLOAT32, scores)),
+        pack_kv('tokenizer.ggml.token_type', ARRAY, (INT32, types)),
+        pack_kv('tokenizer.ggml.unknown_token_id', UINT32, 0),
+        pack_kv('tokenizer.ggml.bos_token_id', UINT32, 1),
+        pack_kv('tokenizer.ggml.eos_token_id', UINT32, 2),
+    ]
+
+    header = b'GGUF' + struct.pack('<IQQ', 3, len(tensors), len(kvs)) + b''.join(kvs)
+    offset = 0
+    for name, dims, ttype in tensors:
+        header += pack_string(name) + struct.pack('<I', len(dims))
+        header += b''.join(struct.pack('<Q', d) for d in dims)
+        header += struct.pack('<IQ', ttype, offset)
+        offset = align(offset + tensor_bytes(dims, ttype))
+
+    data_start = align(len(header))
+    total = data_start + offset
+
+    os.makedirs(os.path.dirname(os.path.abspath(args.output)), exist_ok=True)
+    with open(args.output, 'wb') as f:
+        f.write(header)
+        f.write(b'\0' * (data_start - len(header)))
+        f.truncate(total)  # Zero weights, left as a hole
+
+    print('Wrote %s: %d layers, %d tensors, %.2f GiB' % (args.output, layers, len(tensors), total / (1 << 30)))
+
+
+if __name__ == '__main__':
+    main()
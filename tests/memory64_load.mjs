@@ -0,0 +1,63 @@
+// Headless check that the memory64 build loads a model larger than 4GB.
+// Expects serve.py on BASE_URL with docs/test/synthetic.gguf in place
+// (make test-memory64 sets both up).
+import puppeteer from 'puppeteer';
+
+const BASE_URL = process.env.BASE_URL || 'http://localhost:8000';
+const MODEL_URL = '/test/synthetic.gguf';
+const TIMEOUT_MS = 10 * 60 * 1000;
+const FOUR_GB = 4 * 1024 * 1024 * 1024;
+
+function fail(message) {
+    console.error('FAIL: ' + message);
+    process.exitCode = 1;
+}
+
+const browser = await puppeteer.launch({
+    headless: true,
+    protocolTimeout: TIMEOUT_MS,
+    args: ['--enable-features=WebAssemblyMemory64', '--js-flags=--experimental-wasm-memory64']
+});
+
+try {
+    const page = await browser.newPage();
+
+    // Settles on the app's load result, or on any alert the shell raises
+    const loaded = new Promise((resolve, reject) => {
+        page.on('console', (msg) => {
+            const text = msg.text();
+            console.log('[page] ' + text);
+            if (text.includes('Model loaded successfully')) resolve();
+            else if (text.includes('Not enough memory') || text.includes('Failed to load model')) reject(new Error(text));
+        });
+        page.on('dialog', async (dialog) => {
+            reject(new Error('Dialog: ' + dialog.message()));
+            await dialog.dismiss();
+        });
+        page.on('pageerror', (err) => reject(err));
+    });
+
+    await page.goto(BASE_URL + '/?mem64=1');
+    await page.waitForFunction(() => window.startupTiming, { timeout: TIMEOUT_MS });
+
+    const timing = await page.evaluate(() => window.startupTiming);
+    if (timing.error) throw new Error('Startup failed: ' + timing.error);
+    if (timing.variant !== 'index64') throw new Error('Expected the index64 build, got ' + timing.variant);
+
+    await page.evaluate((url) => window.loadModelFromUrl(url, false), MODEL_URL);
+    await Promise.race([
+        loaded,
+        new Promise((_, reject) => setTimeout(() => reject(new Error('Timed out loading the model')), TIMEOUT_MS))
+    ]);
+
+    const report = await page.evaluate(() => window.getMemoryReport());
+    console.log('Heap: ' + (report.heap.size / (1 << 20)).toFixed(0) + ' MB of ' +
+                (report.heap.max / (1 << 20)).toFixed(0) + ' MB');
+    if (report.heap.size <= FOUR_GB) throw new Error('Heap did not grow past 4GB: ' + report.heap.size);
+
+    console.log('PASS: memory64 build loaded a ' + MODEL_URL + ' model past 4GB');
+} catch (err) {
+    fail(err.message);
+} finally {
+    await browser.close();
+}
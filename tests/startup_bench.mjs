@@ -0,0 +1,64 @@
+// Headless startup benchmark: loads the page RUNS times with streaming wasm
+// compilation and RUNS times with the buffered fetch + compile path, then
+// prints the median and best of each window.startupTiming stage.
+// Expects serve.py on BASE_URL (make bench-startup starts it).
+import puppeteer from 'puppeteer';
+
+const BASE_URL = process.env.BASE_URL || 'http://localhost:8000';
+const RUNS = Number(process.env.RUNS || process.argv[2] || 5);
+const STAGES = ['wasmCompiled', 'runtimeReady', 'interactive'];
+const TIMEOUT_MS = 120 * 1000;
+
+async function loadOnce(browser, query) {
+    // Fresh context per run: no HTTP cache, no compiled-code cache
+    const context = await browser.createBrowserContext();
+    try {
+        const page = await context.newPage();
+        await page.setCacheEnabled(false);
+        await page.goto(BASE_URL + '/' + query);
+        await page.waitForFunction(() => window.startupTiming, { timeout: TIMEOUT_MS });
+        const timing = await page.evaluate(() => window.startupTiming);
+        if (timing.error) throw new Error('Startup failed: ' + timing.error);
+        return timing;
+    } finally {
+        await context.close();
+    }
+}
+
+function median(values) {
+    const sorted = [...values].sort((a, b) => a - b);
+    const mid = sorted.length >> 1;
+    return sorted.length % 2 ? sorted[mid] : Math.round((sorted[mid - 1] + sorted[mid]) / 2);
+}
+
+const browser = await puppeteer.launch({ headless: true });
+try {
+    const modes = [['streaming', '?mem64=0'], ['buffer', '?mem64=0&compile=buffer']];
+    const results = {};
+
+    for (const [mode, query] of modes) {
+        results[mode] = [];
+        for (let i = 0; i < RUNS; i++) {
+            const timing = await loadOnce(browser, query);
+            if (timing.compile !== mode) throw new Error('Expected ' + mode + ' compile, page used ' + timing.compile);
+            console.log(mode + ' run ' + (i + 1) + ': ' + STAGES.map((s) => s + ' ' + timing[s]).join(', '));
+            results[mode].push(timing);
+        }
+    }
+
+    console.log('\nStartup (ms) over ' + RUNS + ' runs, median / best');
+    console.log('stage'.padEnd(14) + modes.map(([mode]) => mode.padStart(16)).join(''));
+    for (const stage of STAGES) {
+        let row = stage.padEnd(14);
+        for (const [mode] of modes) {
+            const values = results[mode].map((t) => t[stage]);
+            row += (median(values) + ' / ' + Math.min(...values)).padStart(16);
+        }
+        console.log(row);
+    }
+} catch (err) {
+    console.error('FAIL: ' + err.message);
+    process.exitCode = 1;
+} finally {
+    await browser.close();
+}